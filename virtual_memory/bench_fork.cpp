@@ -0,0 +1,140 @@
+// Benchmark: fork() from a multi-threaded parent with a large heap.
+//
+// Build and run:
+//  g++ -O2 -std=c++11 -pthread bench_fork.cpp malloc_3.cpp -o bench_fork
+//  ./bench_fork [heap_mb] [forks] [threads]
+//
+// The parent fills heap_mb of pool objects and keeps `threads` threads allocating and freeing (on
+// the object pool, on malloc_3 directly and on a locked policy allocator) while the main thread forks.
+// The pool and the direct malloc_3 blocks are all mmapped, so the policy allocator is the only user
+// of the program break (malloc_3's sbrk heap must not share it, see policy_allocator.h).
+// It reports:
+//  - fork+exec latency: fork, exec /bin/true in the child, wait for it.
+//  - child page copies: the child frees and reallocates 4096 objects and exits; the minor faults
+//    it takes are the pages copy-on-write had to duplicate. For comparison the same child writes
+//    one word into each object, which is what an in-object (intrusive) free list would do.
+// Without the pthread_atfork handlers the children here hang now and then on a pool, heap or policy
+// allocator lock that was held by one of the other threads at the moment of the fork.
+
+#include "object_pool.h"
+#include "policy_allocator.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+void *smalloc(size_t size);
+void sfree(void *p);
+
+#define MAPPED_BLOCK_SIZE (128 * 1024) // MMAP_THRESHOLD: smalloc maps it instead of using the break
+
+struct Object {
+    Object() {} // leaves the payload alone, so only the allocator writes during the child runs
+    char payload[64];
+};
+
+typedef PolicyAllocator<BestFitPlacement, SplitMergeCoalescing<128>, MmapLargeObjects<128 * 1024>, MutexLocking>
+    LockedSplitMerge;
+
+static LockedSplitMerge shared_heap;
+static std::atomic<bool> stop(false);
+
+static void churn(unsigned seed) {
+    std::vector<Object *> objects(256, (Object *)NULL);
+    std::vector<void *> blocks(64, (void *)NULL);
+    std::vector<void *> mapped(4, (void *)NULL);
+    while (!stop.load(std::memory_order_relaxed)) {
+        seed = seed * 1103515245 + 12345;
+        size_t i = seed % objects.size();
+        ObjectPool<Object>::destroy(objects[i]);
+        objects[i] = ObjectPool<Object>::create();
+        size_t j = (seed >> 8) % blocks.size();
+        shared_heap.deallocate(blocks[j]);
+        blocks[j] = shared_heap.allocate(16 + (seed >> 16) % 512);
+        if (seed % 256 == 0) {
+            size_t k = (seed >> 4) % mapped.size();
+            sfree(mapped[k]);
+            mapped[k] = smalloc(MAPPED_BLOCK_SIZE);
+        }
+    }
+    for (Object *object : objects)
+        ObjectPool<Object>::destroy(object);
+    for (void *block : blocks)
+        shared_heap.deallocate(block);
+    for (void *block : mapped)
+        sfree(block);
+}
+
+// runs `child` in a forked process and returns its minor fault count
+template <class Child> static long childFaults(Child child) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        child();
+        _exit(0);
+    }
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    return usage.ru_minflt;
+}
+
+int main(int argc, char *argv[]) {
+    size_t heap_mb = argc > 1 ? atoi(argv[1]) : 256;
+    int forks = argc > 2 ? atoi(argv[2]) : 200;
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+
+    size_t count = heap_mb * 1024 * 1024 / sizeof(Object);
+    std::vector<Object *> heap(count);
+    for (size_t i = 0; i < count; i++) {
+        heap[i] = ObjectPool<Object>::create();
+        heap[i]->payload[0] = (char)i;
+    }
+    printf("parent heap: %zu MB in %zu objects, %d churning threads\n", heap_mb, count, threads);
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.emplace_back(churn, 7 + t);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < forks; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // a child of a threaded parent: allocate before exec, the case atfork protects
+            ObjectPool<Object>::destroy(ObjectPool<Object>::create());
+            shared_heap.deallocate(shared_heap.allocate(100));
+            sfree(smalloc(MAPPED_BLOCK_SIZE));
+            execl("/bin/true", "true", (char *)NULL);
+            _exit(127);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("fork+exec        %8.1f us per child\n", seconds * 1e6 / forks);
+
+    stop = true;
+    for (std::thread &worker : workers)
+        worker.join();
+
+    const size_t touched = 4096 < count ? 4096 : count;
+    long baseline = childFaults([] {});
+    long recycled = childFaults([&] {
+        for (size_t i = 0; i < touched; i++)
+            ObjectPool<Object>::destroy(heap[i * (count / touched)]);
+        for (size_t i = 0; i < touched; i++)
+            ObjectPool<Object>::create();
+    });
+    long intrusive = childFaults([&] {
+        for (size_t i = 0; i < touched; i++)
+            *(void **)heap[i * (count / touched)] = NULL;
+    });
+    printf("child page copies for %zu frees+allocs: %ld (in-object free list would take %ld)\n", touched,
+           recycled - baseline, intrusive - baseline);
+    return 0;
+}
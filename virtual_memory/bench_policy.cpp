@@ -0,0 +1,119 @@
+// Benchmark: the malloc_1/2/3 policy combinations of policy_allocator.h side by side, plus a couple of
+// other combinations, on the same random workload.
+//
+// Build and run:
+//  g++ -O2 -std=c++11 -pthread bench_policy.cpp malloc_3.cpp -o bench_policy
+//  ./bench_policy [operations] [live_slots]
+//
+// For each variant the run reports time per operation, how far the program break moved (heap
+// footprint) and the free block statistics at the end. The bump and first fit rows run the code of
+// malloc_1 and malloc_2 (both are instantiations of the template); malloc_3 runs its own smalloc/sfree
+// next to the split/merge model. malloc_1 cannot resize, so a reallocation there is a new block and a
+// copy, as its users have to do it. malloc_3 runs last: it must own the program break, and the other
+// heaps stay below its blocks once they are done.
+
+#include "policy_allocator.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+void *smalloc(size_t size);
+void sfree(void *p);
+void *srealloc(void *oldp, size_t size);
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+
+typedef PolicyAllocator<FirstFitPlacement, SplitMergeCoalescing<128>, MmapLargeObjects<128 * 1024>, NoLocking>
+    FirstFitSplitMerge;
+typedef PolicyAllocator<BestFitPlacement, SplitMergeCoalescing<128>, MmapLargeObjects<128 * 1024>, MutexLocking>
+    LockedSplitMerge;
+
+// malloc_3's functions behind the same interface as a PolicyAllocator
+struct Malloc3 {
+    static const bool resizable = true;
+    void *allocate(size_t size) {
+        return smalloc(size);
+    }
+    void deallocate(void *p) {
+        sfree(p);
+    }
+    void *reallocate(void *oldp, size_t size) {
+        return srealloc(oldp, size);
+    }
+    size_t numFreeBlocks() const {
+        return _num_free_blocks();
+    }
+    size_t numFreeBytes() const {
+        return _num_free_bytes();
+    }
+};
+
+template <class Allocator> static char *resize(Allocator &allocator, char *p, size_t, size_t size, std::true_type) {
+    return (char *)allocator.reallocate(p, size);
+}
+
+template <class Allocator>
+static char *resize(Allocator &allocator, char *p, size_t old_size, size_t size, std::false_type) {
+    char *bigger = (char *)allocator.allocate(size);
+    if (bigger != NULL)
+        memcpy(bigger, p, old_size < size ? old_size : size);
+    allocator.deallocate(p);
+    return bigger;
+}
+
+template <class Allocator> static void run(const char *name, int operations, int slots) {
+    static Allocator allocator; // one heap per variant, kept for the whole run
+    std::mt19937 rng(42);
+    std::vector<char *> live(slots, (char *)NULL);
+    std::vector<size_t> sizes(slots, 0);
+
+    char *break_before = (char *)sbrk(0);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < operations; i++) {
+        int slot = rng() % slots;
+        size_t size = rng() % 16 == 0 ? 131072 + rng() % 65536 : 16 + rng() % 2048;
+        if (live[slot] == NULL) {
+            live[slot] = (char *)allocator.allocate(size);
+            sizes[slot] = size;
+        } else if (rng() % 4 == 0) {
+            live[slot] = resize(allocator, live[slot], sizes[slot], size,
+                                std::integral_constant<bool, Allocator::resizable>());
+            sizes[slot] = size;
+        } else {
+            allocator.deallocate(live[slot]);
+            live[slot] = NULL;
+            continue;
+        }
+        if (live[slot] == NULL) {
+            printf("%-22s out of memory after %d operations\n", name, i);
+            return;
+        }
+        live[slot][0] = live[slot][sizes[slot] - 1] = (char)i; // touch both ends
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    long heap_growth = (long)((char *)sbrk(0) - break_before);
+    printf("%-22s %8.1f ns/op  heap +%7ld KB  free blocks %6zu  free KB %8zu\n", name, seconds * 1e9 / operations,
+           heap_growth / 1024, allocator.numFreeBlocks(), allocator.numFreeBytes() / 1024);
+    for (int slot = 0; slot < slots; slot++) {
+        allocator.deallocate(live[slot]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int operations = argc > 1 ? atoi(argv[1]) : 200000;
+    int slots = argc > 2 ? atoi(argv[2]) : 1000;
+    printf("%d operations over %d live slots\n", operations, slots);
+
+    run<BumpAllocator>("bump (malloc_1)", operations, slots);
+    run<FirstFitAllocator>("first fit (malloc_2)", operations, slots);
+    run<SplitMergeAllocator>("split/merge model", operations, slots);
+    run<FirstFitSplitMerge>("first fit+split/merge", operations, slots);
+    run<LockedSplitMerge>("split/merge + mutex", operations, slots);
+    run<Malloc3>("malloc_3", operations, slots);
+    return 0;
+}
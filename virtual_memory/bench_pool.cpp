@@ -0,0 +1,69 @@
+// Benchmark: std::map with the default allocator vs the same map on PoolAllocator (object_pool.h).
+//
+// Build and run:
+//  g++ -O2 -std=c++11 -pthread bench_pool.cpp malloc_3.cpp -o bench_pool
+//  ./bench_pool [keys] [rounds] [threads]
+//
+// Every round fills a map with random keys and then erases all of them, which is the
+// allocate-now/free-later pattern of short lived node objects.
+
+#include "object_pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+typedef std::map<int, long> DefaultMap;
+typedef std::map<int, long, std::less<int>, PoolAllocator<std::pair<const int, long>>> PooledMap;
+
+template <class Map> static long churn(int keys, int rounds, unsigned seed) {
+    std::mt19937 rng(seed);
+    long checksum = 0;
+    for (int round = 0; round < rounds; round++) {
+        Map map;
+        for (int i = 0; i < keys; i++) {
+            map[(int)rng()] = i;
+        }
+        for (typename Map::iterator it = map.begin(); it != map.end(); it = map.erase(it)) {
+            checksum += it->second;
+        }
+    }
+    return checksum;
+}
+
+template <class Map> static double run(const char *name, int keys, int rounds, int threads) {
+    std::vector<std::thread> workers;
+    std::vector<long> results(threads);
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] { results[t] = churn<Map>(keys, rounds, 1234 + t); });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double ops = 2.0 * keys * rounds * threads; // one insert and one erase per key
+    printf("%-8s %8.3f s  %8.1f ns/op  (checksum %ld)\n", name, seconds, seconds * 1e9 / ops, results[0]);
+    return seconds;
+}
+
+int main(int argc, char *argv[]) {
+    int keys = argc > 1 ? atoi(argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    int threads = argc > 3 ? atoi(argv[3]) : 1;
+    printf("std::map<int, long>: %d keys, %d rounds, %d threads\n", keys, rounds, threads);
+
+    // warm both allocators up so the first measured round does not pay for growing them
+    churn<DefaultMap>(keys, 1, 1);
+    churn<PooledMap>(keys, 1, 1);
+
+    double base = run<DefaultMap>("default", keys, rounds, threads);
+    double pooled = run<PooledMap>("pool", keys, rounds, threads);
+    printf("speedup  %8.2fx\n", base / pooled);
+    return 0;
+}
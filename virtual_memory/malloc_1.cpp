@@ -1,14 +1,103 @@
+#include "policy_allocator.h"
+
 #include <math.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #define SIZE_LIMIT pow(10, 8)
+#define ARENA_ALIGNMENT 16
+#define ARENA_COMMIT_STEP (1024 * 1024) // reserved range is made accessible this much at a time
+
+// every request is a fresh sbrk of exactly size bytes (BumpAllocator, see policy_allocator.h)
+static BumpAllocator Heap;
 
 void *smalloc(size_t size) {
-    if (size == 0 || size > SIZE_LIMIT)
+    return Heap.allocate(size);
+}
+
+// Monotonic arena: the same pointer bump as smalloc, but in a private virtual range reserved up front
+// (so it works next to any other heap) and with a way back. Phase structured work takes a checkpoint,
+// allocates freely, and rewinds to the checkpoint (or resets the arena) when the phase is over.
+// Pages stay committed across rewinds, so the next phase does not fault them in again.
+struct MonotonicArena {
+    char *base;       // start of the reserved range, this header lives there
+    size_t reserved;  // bytes of address space reserved
+    size_t committed; // bytes at the start of the range that are readable and writable
+    size_t used;      // bump offset from base
+};
+
+MonotonicArena *sarena_create(size_t reserve);
+void *sarena_alloc(MonotonicArena *arena, size_t size);
+size_t sarena_checkpoint(MonotonicArena *arena);
+void sarena_rewind(MonotonicArena *arena, size_t checkpoint);
+void sarena_reset(MonotonicArena *arena);
+void sarena_destroy(MonotonicArena *arena);
+
+static inline size_t arenaAlign(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static bool arenaCommit(MonotonicArena *arena, size_t needed) {
+    if (needed <= arena->committed)
+        return true;
+    size_t target = arenaAlign(needed, ARENA_COMMIT_STEP);
+    if (target > arena->reserved)
+        target = arena->reserved;
+    if (mprotect(arena->base + arena->committed, target - arena->committed, PROT_READ | PROT_WRITE) != 0)
+        return false;
+    arena->committed = target;
+    return true;
+}
+
+// reserve address space only; memory is committed as the bump pointer reaches it
+MonotonicArena *sarena_create(size_t reserve) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    reserve = arenaAlign(reserve < page ? page : reserve, page);
+    void *base = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
         return NULL;
-    void *address = sbrk(size);
-    if (address == (void *)-1)
+    MonotonicArena header = {(char *)base, reserve, 0, 0};
+    if (!arenaCommit(&header, sizeof(MonotonicArena))) {
+        munmap(base, reserve);
         return NULL;
-    else
-        return address;
-}
\ No newline at end of file
+    }
+    MonotonicArena *arena = (MonotonicArena *)base;
+    *arena = header;
+    arena->used = arenaAlign(sizeof(MonotonicArena), ARENA_ALIGNMENT);
+    return arena;
+}
+
+void *sarena_alloc(MonotonicArena *arena, size_t size) {
+    if (arena == NULL || size == 0 || size > SIZE_LIMIT)
+        return NULL;
+    size_t end = arena->used + arenaAlign(size, ARENA_ALIGNMENT);
+    if (end > arena->reserved || !arenaCommit(arena, end))
+        return NULL;
+    void *address = arena->base + arena->used;
+    arena->used = end;
+    return address;
+}
+
+// a checkpoint is just the current bump offset (0 for no arena, which rewinds nothing)
+size_t sarena_checkpoint(MonotonicArena *arena) {
+    if (arena == NULL)
+        return 0;
+    return arena->used;
+}
+
+// drop everything allocated after the checkpoint was taken
+void sarena_rewind(MonotonicArena *arena, size_t checkpoint) {
+    if (arena != NULL && checkpoint < arena->used && checkpoint >= arenaAlign(sizeof(MonotonicArena), ARENA_ALIGNMENT))
+        arena->used = checkpoint;
+}
+
+void sarena_reset(MonotonicArena *arena) {
+    if (arena != NULL)
+        arena->used = arenaAlign(sizeof(MonotonicArena), ARENA_ALIGNMENT);
+}
+
+void sarena_destroy(MonotonicArena *arena) {
+    if (arena != NULL)
+        munmap(arena->base, arena->reserved);
+}
@@ -1,12 +1,25 @@
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/random.h>
 #include <unistd.h>
 
 #define SIZE_LIMIT 1e8 // pow(10, 8)
 #define SPLIT_THRESHOLD 128
 #define MMAP_THRESHOLD (128 * 1024)
+#define PURGE_THRESHOLD (64 * 1024) // free blocks at least this big get their interior pages returned
+#define PURGE_DECAY 256             // sfree calls a block has to stay free before it is purged
+#define PURGE_INTERVAL 64           // sfree calls between two purge passes
+#define REGION_CHUNK_SIZE (256 * 1024) // above MMAP_THRESHOLD, so every chunk is its own mapping
+#define REGION_ALIGNMENT 16
+#ifndef SAFE_LINKING
+#define SAFE_LINKING 1 // build with -DSAFE_LINKING=0 to store plain next/prev pointers (see bench_safe_linking.cpp)
+#endif
 
 // point of interest (checking with tests): should size be the allocation size
 // or the overall size (including the metadata), givin that we assume the user asked
@@ -14,6 +27,10 @@
 
 // Answer: according to the tests, size is what the user wants and does not include meta data
 
+// Blocks below MMAP_THRESHOLD are carved from the program break and walked in address order up to
+// sbrk(0) (merge, purge, srealloc), so nothing else in the process may move the break while they are
+// in use. object_pool.h keeps its slabs mmapped for this reason, see also policy_allocator.h.
+
 void *smalloc(size_t size);
 void *scalloc(size_t num, size_t size);
 void sfree(void *p);
@@ -24,15 +41,34 @@ size_t _num_allocated_blocks();
 size_t _num_allocated_bytes();
 size_t _num_meta_data_bytes();
 size_t _size_meta_data();
+size_t _num_purged_bytes();
+
+struct Region;
+Region *sregion_create(Region *parent);
+void *sregion_alloc(Region *region, size_t size);
+void sregion_release(Region *region);
+
+// Per-process random value. rand() is unseeded and would give the same cookie on every run,
+// so take it from the kernel and fall back to address/pid entropy only if getrandom fails.
+static uintptr_t randomWord() {
+    uintptr_t value;
+    if (getrandom(&value, sizeof(value), GRND_NONBLOCK) != (ssize_t)sizeof(value)) {
+        value = (uintptr_t)&value ^ ((uintptr_t)getpid() << 16) ^ (uintptr_t)sbrk(0);
+    }
+    return value;
+}
 
-static const int32_t MAIN_COOKIE = rand();
+static const int32_t MAIN_COOKIE = (int32_t)randomWord();
+static const uintptr_t LINK_KEY = randomWord();
 
 struct MallocMetadata {
     int32_t cookie;
+    uint32_t free_epoch; // Heap.epoch when the block became free (fills the padding after the cookie)
     size_t size;
     bool is_free;
-    MallocMetadata *next;
-    MallocMetadata *prev;
+    bool is_purged; // interior pages were given back with madvise, contents are gone
+    uintptr_t next_link; // mangled, access only through getNext/setNext
+    uintptr_t prev_link; // mangled, access only through getPrev/setPrev
 };
 
 struct MemoryList {
@@ -49,10 +85,48 @@ struct MemoryList {
     size_t num_allocated_bytes = 0;
 
     size_t num_meta_data_bytes = 0;
+
+    uint32_t epoch = 0;          // number of sfree calls, the clock of the purge decay
+    size_t num_purged_bytes = 0; // bytes of free blocks that are currently not resident
+    int purge_advice = MADV_FREE;
 };
 
 static MemoryList Heap; // although named heap it consists of all memory allocated
 
+// One lock for the whole heap: the object pools (object_pool.h) call in from every thread, and so
+// may the program around them. Recursive, since scalloc, srealloc and the regions call smalloc/sfree.
+static pthread_mutex_t HeapLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+struct HeapGuard {
+    HeapGuard() {
+        pthread_mutex_lock(&HeapLock);
+    }
+    ~HeapGuard() {
+        pthread_mutex_unlock(&HeapLock);
+    }
+};
+
+// Hold the heap lock across fork(), so the child never starts with it taken by a thread that was not
+// copied. The child gets a fresh lock: a recursive mutex remembers its owner's thread id, and the
+// forking thread has a new one in the child. Registered before main, so the handlers of the object
+// pools (registered on first use) take their locks first, the order in which grow() takes them.
+static void heapLockPrepare() {
+    pthread_mutex_lock(&HeapLock);
+}
+
+static void heapLockParent() {
+    pthread_mutex_unlock(&HeapLock);
+}
+
+static void heapLockChild() {
+    pthread_mutex_t fresh = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+    HeapLock = fresh;
+}
+
+__attribute__((constructor)) static void heapLockAtFork() {
+    pthread_atfork(heapLockPrepare, heapLockParent, heapLockChild);
+}
+
 // Validate that the cookie did not change. exit if does.
 // Must be use before every metadata access.
 // From piazza: You are allowed to check once before the first access to the metadata (assume when your code runs,
@@ -63,6 +137,34 @@ void validateCookie(MallocMetadata *alloc) {
     }
 }
 
+// Safe-linking: list links are stored XORed with the per-process key and with the address of the
+// field holding them, so an overflow into the metadata can not plant a usable pointer.
+// Both directions are the same xor, which keeps every list access a couple of bit operations.
+static inline uintptr_t mangleLink(const uintptr_t *field, uintptr_t value) {
+#if SAFE_LINKING
+    return value ^ LINK_KEY ^ ((uintptr_t)field >> 12);
+#else
+    (void)field;
+    return value;
+#endif
+}
+
+static inline MallocMetadata *getNext(MallocMetadata *block) {
+    return (MallocMetadata *)mangleLink(&block->next_link, block->next_link);
+}
+
+static inline MallocMetadata *getPrev(MallocMetadata *block) {
+    return (MallocMetadata *)mangleLink(&block->prev_link, block->prev_link);
+}
+
+static inline void setNext(MallocMetadata *block, MallocMetadata *next) {
+    block->next_link = mangleLink(&block->next_link, (uintptr_t)next);
+}
+
+static inline void setPrev(MallocMetadata *block, MallocMetadata *prev) {
+    block->prev_link = mangleLink(&block->prev_link, (uintptr_t)prev);
+}
+
 // New allocation adjustment
 void newAllocAdjustment(size_t size) {
     Heap.num_allocated_blocks += 1;
@@ -79,8 +181,9 @@ void *firstAllocation(size_t size) {
     Heap.head = (MallocMetadata *)meta_data_address;
     Heap.head->cookie = MAIN_COOKIE;
     Heap.head->is_free = false;
-    Heap.head->next = NULL;
-    Heap.head->prev = NULL;
+    Heap.head->is_purged = false;
+    setNext(Heap.head, NULL);
+    setPrev(Heap.head, NULL);
     Heap.head->size = size;
     Heap.wilderness = Heap.head;
     Heap.firsthead = Heap.head;
@@ -93,78 +196,78 @@ void HeapListInsert(MallocMetadata *new_alloc) {
     MallocMetadata *ptr = Heap.head;
     if (ptr != NULL) {
         validateCookie(ptr);
-        while (ptr->next != NULL) {
+        while (getNext(ptr) != NULL) {
             validateCookie(new_alloc);
-            if (new_alloc->size >= ptr->size && new_alloc->size < ptr->next->size) { 
+            if (new_alloc->size >= ptr->size && new_alloc->size < getNext(ptr)->size) { 
                 if (new_alloc->size == ptr->size) {
                     if (new_alloc > ptr) {
-                        MallocMetadata *next = ptr->next;
-                        new_alloc->next = next;
-                        new_alloc->prev = ptr;
-                        ptr->next = new_alloc;
-                        next->prev = new_alloc;
+                        MallocMetadata *next = getNext(ptr);
+                        setNext(new_alloc, next);
+                        setPrev(new_alloc, ptr);
+                        setNext(ptr, new_alloc);
+                        setPrev(next, new_alloc);
                     } else {
                         if (ptr == Heap.head) {
                             Heap.head = new_alloc;
-                            new_alloc->next = ptr;
-                            new_alloc->prev = NULL;
-                            ptr->prev = new_alloc;
+                            setNext(new_alloc, ptr);
+                            setPrev(new_alloc, NULL);
+                            setPrev(ptr, new_alloc);
                         } else {
-                            MallocMetadata *prev = ptr->prev;
-                            new_alloc->next = ptr;
-                            new_alloc->prev = prev;
-                            ptr->prev = new_alloc;
-                            prev->next = new_alloc;
+                            MallocMetadata *prev = getPrev(ptr);
+                            setNext(new_alloc, ptr);
+                            setPrev(new_alloc, prev);
+                            setPrev(ptr, new_alloc);
+                            setNext(prev, new_alloc);
                         }
                     }
                 } else {
-                    MallocMetadata *next = ptr->next;
-                    new_alloc->next = next;
-                    new_alloc->prev = ptr;
-                    ptr->next = new_alloc;
-                    next->prev = new_alloc;
+                    MallocMetadata *next = getNext(ptr);
+                    setNext(new_alloc, next);
+                    setPrev(new_alloc, ptr);
+                    setNext(ptr, new_alloc);
+                    setPrev(next, new_alloc);
                 }
                 return;
             }
-            ptr = ptr->next;
+            ptr = getNext(ptr);
             validateCookie(ptr);
         }
         if (ptr->size <= new_alloc->size) {
             if (ptr->size == new_alloc->size) {
                 if (new_alloc > ptr) {
-                    ptr->next = new_alloc;
-                    new_alloc->prev = ptr;
-                    new_alloc->next = NULL;
+                    setNext(ptr, new_alloc);
+                    setPrev(new_alloc, ptr);
+                    setNext(new_alloc, NULL);
                 } else {
                     if (ptr == Heap.head) {
                         Heap.head = new_alloc;
-                        new_alloc->next = ptr;
-                        new_alloc->prev = NULL;
-                        ptr->prev = new_alloc;
+                        setNext(new_alloc, ptr);
+                        setPrev(new_alloc, NULL);
+                        setPrev(ptr, new_alloc);
                     } else {
-                        MallocMetadata *prev = ptr->prev;
-                        new_alloc->next = ptr;
-                        new_alloc->prev = prev;
-                        ptr->prev = new_alloc;
-                        prev->next = new_alloc;
+                        MallocMetadata *prev = getPrev(ptr);
+                        setNext(new_alloc, ptr);
+                        setPrev(new_alloc, prev);
+                        setPrev(ptr, new_alloc);
+                        setNext(prev, new_alloc);
                     }
                 }
             } else {
-                ptr->next = new_alloc;
-                new_alloc->prev = ptr;
-                new_alloc->next = NULL;
+                setNext(ptr, new_alloc);
+                setPrev(new_alloc, ptr);
+                setNext(new_alloc, NULL);
             }
         } else {
-            //assert(ptr == Heap.head); ////////////
-            ptr->prev = new_alloc;
-            new_alloc->next = ptr;
-            new_alloc->prev = NULL;
+            // smaller than every block in the list. ptr is the tail here, not the head
+            setPrev(Heap.head, new_alloc);
+            setNext(new_alloc, Heap.head);
+            setPrev(new_alloc, NULL);
             Heap.head = new_alloc;
         }
     } else {
         Heap.head = new_alloc;
-        new_alloc->next = NULL;
-        new_alloc->prev = NULL;
+        setNext(new_alloc, NULL);
+        setPrev(new_alloc, NULL);
     }
 }
 
@@ -173,23 +276,82 @@ void HeapListRemove(MallocMetadata *block) {
     validateCookie(block);
     validateCookie(Heap.head);
     if (block == Heap.head) {
-        Heap.head = block->next;
+        Heap.head = getNext(block);
         if (Heap.head != NULL)
-            Heap.head->prev = NULL;
+            setPrev(Heap.head, NULL);
 
     } else {
-        if (block->next != NULL) {
-            block->next->prev = block->prev;
-            validateCookie(block->next);
+        if (getNext(block) != NULL) {
+            setPrev(getNext(block), getPrev(block));
+            validateCookie(getNext(block));
         }
-        validateCookie(block->prev);
-        block->prev->next = block->next;
+        validateCookie(getPrev(block));
+        setNext(getPrev(block), getNext(block));
     } // THe only case in which block->prev is Null is when its the head
 }
 
+// Purging. Merges can leave big free blocks in the middle of the heap, and only the wilderness could
+// ever shrink, so without this their pages would stay resident forever. Once such a block has stayed
+// free for PURGE_DECAY frees, the whole pages inside its payload are handed back to the kernel.
+// The metadata of this block and of the next one are outside that range and stay untouched.
+static void purgeSpan(MallocMetadata *block, char **start, size_t *length) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)(block + 1) + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)(block + 1) + block->size) & ~(page - 1);
+    *start = (char *)begin;
+    *length = end > begin ? end - begin : 0;
+}
+
+// Forget the purged state of a block that is about to be reused, resized or merged.
+// The pages fault back in (zero filled, or with their old contents under MADV_FREE) on first touch.
+static void unpurge(MallocMetadata *block) {
+    if (block->is_purged) {
+        char *start;
+        size_t length;
+        purgeSpan(block, &start, &length);
+        Heap.num_purged_bytes -= length;
+        block->is_purged = false;
+    }
+}
+
+static void purgeBlock(MallocMetadata *block) {
+    char *start;
+    size_t length;
+    purgeSpan(block, &start, &length);
+    if (length == 0)
+        return;
+    if (madvise(start, length, Heap.purge_advice) != 0) {
+        // MADV_FREE needs Linux 4.5, fall back to MADV_DONTNEED for good
+        if (errno != EINVAL || Heap.purge_advice == MADV_DONTNEED)
+            return;
+        Heap.purge_advice = MADV_DONTNEED;
+        if (madvise(start, length, Heap.purge_advice) != 0)
+            return;
+    }
+    block->is_purged = true;
+    Heap.num_purged_bytes += length;
+}
+
+// walk the heap in address order (like merge) and purge the big free blocks that decayed
+void purge() {
+    void *limit = sbrk(0);
+    if (Heap.firsthead == NULL || limit == (void *)-1)
+        return;
+    MallocMetadata *ptr = Heap.firsthead;
+    while ((void *)ptr != limit) {
+        validateCookie(ptr);
+        if (ptr->is_free && !ptr->is_purged && ptr->size >= PURGE_THRESHOLD &&
+            Heap.epoch - ptr->free_epoch >= PURGE_DECAY) {
+            purgeBlock(ptr);
+        }
+        ptr = (MallocMetadata *)((char *)ptr + ptr->size + sizeof(MallocMetadata));
+    }
+}
+
 // splits a block and adjusts parameters in case it is possible
 void split(MallocMetadata *request, size_t new_size) {
     validateCookie(request);
+    unpurge(request);
     if ((int)request->size - (int)new_size - (int)sizeof(MallocMetadata) >= SPLIT_THRESHOLD) {
         void *new_block = (void *)(request);
         new_block = (void *)((char *)new_block + new_size + sizeof(MallocMetadata));
@@ -200,6 +362,8 @@ void split(MallocMetadata *request, size_t new_size) {
 
         new_block_data->cookie = MAIN_COOKIE;
         new_block_data->is_free = true;
+        new_block_data->is_purged = false;
+        new_block_data->free_epoch = Heap.epoch;
         new_block_data->size = request->size - new_size - sizeof(MallocMetadata);
 
         if (request->is_free == false) {
@@ -252,7 +416,10 @@ void smerge(void *limit, void *ptr) {
         smerge(limit, next);
     } else {
 
+        unpurge(ptr_md);
+        unpurge(next_md);
         ptr_md->size += (next_md->size + sizeof(MallocMetadata));
+        ptr_md->free_epoch = Heap.epoch;
 
         Heap.num_free_blocks -= 1;
         Heap.num_free_bytes += sizeof(MallocMetadata);
@@ -282,34 +449,36 @@ void merge() {
 }
 
 void *smalloc(size_t size) {
+    HeapGuard guard;
     if (size == 0 || size > SIZE_LIMIT)
         return NULL;
 
     // MMAP implementation
     if (size >= MMAP_THRESHOLD) {
         void *meta_data_address = mmap(NULL, size + (size_t)sizeof(MallocMetadata), PROT_READ | PROT_WRITE,
-                                       MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+                                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0); // a child's writes stay in the child
         if (meta_data_address == MAP_FAILED)
             return NULL;
         void *address = (void *)((MallocMetadata *)meta_data_address + 1);
         MallocMetadata *new_alloc = (MallocMetadata *)meta_data_address;
         new_alloc->cookie = MAIN_COOKIE;
         new_alloc->is_free = false;
+        new_alloc->is_purged = false;
         new_alloc->size = size;
-        new_alloc->next = NULL;
-        new_alloc->prev = NULL;
+        setNext(new_alloc, NULL);
+        setPrev(new_alloc, NULL);
         newAllocAdjustment(size);
         if (Heap.mmhead == NULL) {
             Heap.mmhead = new_alloc;
             validateCookie(new_alloc);
         } else {
             MallocMetadata *ptr = Heap.mmhead;
-            while (ptr->next != NULL){
+            while (getNext(ptr) != NULL){
                 validateCookie(ptr);
-                ptr = ptr->next;
+                ptr = getNext(ptr);
             }
-            ptr->next = new_alloc;
-            new_alloc->prev = ptr;
+            setNext(ptr, new_alloc);
+            setPrev(new_alloc, ptr);
         }
         return address;
     }
@@ -328,7 +497,7 @@ void *smalloc(size_t size) {
             void *address = (void *)(ptr + 1);
             return address;
         }
-        ptr = ptr->next;
+        ptr = getNext(ptr);
     } while (ptr != NULL);
 
     validateCookie(Heap.wilderness);
@@ -343,6 +512,7 @@ void *smalloc(size_t size) {
         void *address = (void *)(Heap.wilderness + 1);
 
         HeapListRemove(Heap.wilderness);
+        unpurge(Heap.wilderness);
         Heap.wilderness->is_free = false;
         Heap.wilderness->size += needed;
         HeapListInsert(Heap.wilderness);
@@ -363,6 +533,7 @@ void *smalloc(size_t size) {
     Heap.wilderness = new_alloc;
     new_alloc->cookie = MAIN_COOKIE;
     new_alloc->is_free = false;
+    new_alloc->is_purged = false;
     new_alloc->size = size;
     newAllocAdjustment(size);
 
@@ -373,6 +544,7 @@ void *smalloc(size_t size) {
 }
 
 void *scalloc(size_t num, size_t size) {
+    HeapGuard guard;
     void *address = smalloc(num * size);
     if (address == NULL)
         return NULL;
@@ -381,6 +553,7 @@ void *scalloc(size_t num, size_t size) {
 }
 
 void sfree(void *p) {
+    HeapGuard guard;
     if (p == NULL)
         return;
     MallocMetadata *P_meta_data = (MallocMetadata *)p - 1;
@@ -388,17 +561,17 @@ void sfree(void *p) {
     if (P_meta_data->size >= MMAP_THRESHOLD) {
 
         if (P_meta_data == Heap.mmhead) {
-            Heap.mmhead = P_meta_data->next;
-            if (P_meta_data->next != NULL) {
-                validateCookie(P_meta_data->next);
-                P_meta_data->next->prev = NULL;
+            Heap.mmhead = getNext(P_meta_data);
+            if (getNext(P_meta_data) != NULL) {
+                validateCookie(getNext(P_meta_data));
+                setPrev(getNext(P_meta_data), NULL);
             }
         } else {
             //assert(P_meta_data->prev != NULL);
-            P_meta_data->prev->next = P_meta_data->next;
-            validateCookie(P_meta_data->prev);
-            if (P_meta_data->next != NULL) {
-                P_meta_data->next->prev = P_meta_data->prev;
+            setNext(getPrev(P_meta_data), getNext(P_meta_data));
+            validateCookie(getPrev(P_meta_data));
+            if (getNext(P_meta_data) != NULL) {
+                setPrev(getNext(P_meta_data), getPrev(P_meta_data));
             }
         }
 
@@ -409,9 +582,12 @@ void sfree(void *p) {
     } else {
         if (P_meta_data->is_free == false) {
             P_meta_data->is_free = true;
+            P_meta_data->free_epoch = ++Heap.epoch;
             Heap.num_free_blocks += 1;
             Heap.num_free_bytes += P_meta_data->size;
             merge();
+            if (Heap.epoch % PURGE_INTERVAL == 0)
+                purge();
         }
     }
     return;
@@ -437,6 +613,7 @@ void *mmapsrealloc(void *oldp, size_t size) {
 }
 
 void *srealloc(void *oldp, size_t size) {
+    HeapGuard guard;
     if (oldp == NULL)
         return smalloc(size);
     if (size == 0 || size > SIZE_LIMIT)
@@ -444,6 +621,9 @@ void *srealloc(void *oldp, size_t size) {
 
     MallocMetadata *oldp_meta_data = (MallocMetadata *)oldp - 1;
     validateCookie(oldp_meta_data);
+    // once the block is merged into a lower one its metadata is part of that block's payload, and a
+    // split can write a new header over it (or over the data): copy first, with the size kept here
+    size_t old_size = oldp_meta_data->size;
 
     // in case of a mmap alloc
     if (oldp_meta_data->size >= MMAP_THRESHOLD) {
@@ -453,6 +633,10 @@ void *srealloc(void *oldp, size_t size) {
     // a. Try to reuse the current block without any merging.
     if (oldp_meta_data->size >= size) {
         split(oldp_meta_data, size);
+        // the tail left by a split may border a free block, every other path relies on free
+        // neighbours being merged
+        if (oldp_meta_data->size != old_size)
+            merge();
         return oldp;
     }
 
@@ -495,10 +679,10 @@ void *srealloc(void *oldp, size_t size) {
             if (next != NULL) {
                 next->is_free = nextState;
             }
+            void *address = (void *)(prev + 1);
+            memmove(address, oldp, old_size);
             split(prev, size);
             merge();
-            void *address = (void *)(prev + 1);
-            memmove(address, oldp, oldp_meta_data->size);
             return address;
         } else {
             if (is_wild) {
@@ -512,7 +696,7 @@ void *srealloc(void *oldp, size_t size) {
                 if (bonus == (void *)-1)
                     return NULL;
                 void *address = (void *)(prev + 1);
-                memmove(address, oldp, oldp_meta_data->size);
+                memmove(address, oldp, old_size);
                 HeapListRemove(Heap.wilderness);
                 Heap.wilderness->size += needed;
                 HeapListInsert(Heap.wilderness);
@@ -572,12 +756,12 @@ void *srealloc(void *oldp, size_t size) {
             Heap.num_free_blocks += 1;
             Heap.num_free_bytes += oldp_meta_data->size;
             merge();
+            void *address = (void *)(prev + 1);
+            memmove(address, oldp, old_size);
             split(prev, size);
             //prev->is_free = false;
             //Heap.num_free_blocks -= 1;//IN case e didnt need split
             //Heap.num_free_bytes -= prev->size;
-            void *address = (void *)(prev + 1);
-            memmove(address, oldp, oldp_meta_data->size);
             return address;
         }
     }
@@ -594,11 +778,12 @@ void *srealloc(void *oldp, size_t size) {
                 Heap.num_free_blocks += 1;
                 Heap.num_free_bytes += oldp_meta_data->size;
                 merge();
+                unpurge(prev);
                 prev->is_free = false;
                 Heap.num_free_blocks -= 1;
                 Heap.num_free_bytes -= prev->size;
                 void *address = (void *)(prev + 1);
-                memmove(address, oldp, oldp_meta_data->size);
+                memmove(address, oldp, old_size);
 
                 //assert(prev == Heap.wilderness);
                 // calculate needed size
@@ -620,6 +805,7 @@ void *srealloc(void *oldp, size_t size) {
                 Heap.num_free_blocks += 1;
                 Heap.num_free_bytes += oldp_meta_data->size;
                 merge();
+                unpurge(oldp_meta_data);
                 oldp_meta_data->is_free = false;
                 Heap.num_free_blocks -= 1;
                 Heap.num_free_bytes -= oldp_meta_data->size;
@@ -657,6 +843,133 @@ void *srealloc(void *oldp, size_t size) {
     return newp;
 }
 
+// Regions (arenas) for memory that dies together, e.g. everything allocated while serving one request.
+// A region bump-allocates from chunks taken from smalloc (each one mmapped, see REGION_CHUNK_SIZE) and is
+// released as a whole, one sfree per chunk instead of one sfree and merge per allocation.
+// Regions can be nested: releasing a region releases all of its children as well.
+struct RegionChunk {
+    RegionChunk *next;
+    char *top; // next free byte of the payload after this header
+    char *end;
+};
+
+struct Region {
+    RegionChunk *chunks; // current chunk first
+    Region *parent;
+    Region *children;
+    Region *next_sibling;
+    Region *prev_sibling;
+};
+
+static inline size_t regionAlign(size_t size) {
+    return (size + REGION_ALIGNMENT - 1) & ~(size_t)(REGION_ALIGNMENT - 1);
+}
+
+// smalloc only guarantees 8 byte alignment (the metadata is not a multiple of 16), so the payload
+// start is aligned as an address, not as an offset into the chunk
+static inline char *regionAlignAddress(char *address) {
+    return (char *)regionAlign((uintptr_t)address);
+}
+
+static RegionChunk *regionNewChunk(size_t min_payload) {
+    size_t total = sizeof(RegionChunk) + REGION_ALIGNMENT - 1 + min_payload; // room for aligning the payload
+    if (total < REGION_CHUNK_SIZE)
+        total = REGION_CHUNK_SIZE;
+    RegionChunk *chunk = (RegionChunk *)smalloc(total);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = NULL;
+    chunk->top = regionAlignAddress((char *)(chunk + 1));
+    chunk->end = (char *)chunk + total;
+    return chunk;
+}
+
+static inline size_t regionRoom(RegionChunk *chunk) {
+    return chunk->end - chunk->top;
+}
+
+// bump allocation from the current chunk, no per allocation metadata.
+// size is a multiple of REGION_ALIGNMENT, so top stays aligned
+static void *regionBump(RegionChunk *chunk, size_t size) {
+    if (regionRoom(chunk) < size)
+        return NULL;
+    void *address = chunk->top;
+    chunk->top += size;
+    return address;
+}
+
+// create a region. the region header itself lives at the start of its first chunk
+Region *sregion_create(Region *parent) {
+    HeapGuard guard;
+    RegionChunk *chunk = regionNewChunk(0);
+    if (chunk == NULL)
+        return NULL;
+    Region *region = (Region *)regionBump(chunk, regionAlign(sizeof(Region)));
+    region->chunks = chunk;
+    region->parent = parent;
+    region->children = NULL;
+    region->prev_sibling = NULL;
+    region->next_sibling = NULL;
+    if (parent != NULL) {
+        region->next_sibling = parent->children;
+        if (parent->children != NULL)
+            parent->children->prev_sibling = region;
+        parent->children = region;
+    }
+    return region;
+}
+
+void *sregion_alloc(Region *region, size_t size) {
+    HeapGuard guard;
+    if (region == NULL || size == 0 || size > SIZE_LIMIT)
+        return NULL;
+    size = regionAlign(size);
+    void *address = regionBump(region->chunks, size);
+    if (address != NULL)
+        return address;
+
+    RegionChunk *chunk = regionNewChunk(size);
+    if (chunk == NULL)
+        return NULL;
+    if (regionRoom(chunk) - size < regionRoom(region->chunks)) {
+        // oversized request: keep bumping from the current chunk, which has more room left
+        chunk->next = region->chunks->next;
+        region->chunks->next = chunk;
+    } else {
+        chunk->next = region->chunks;
+        region->chunks = chunk;
+    }
+    return regionBump(chunk, size);
+}
+
+// release the region, everything allocated from it and all of its nested regions
+void sregion_release(Region *region) {
+    HeapGuard guard;
+    if (region == NULL)
+        return;
+    while (region->children != NULL) {
+        Region *child = region->children;
+        region->children = child->next_sibling;
+        child->parent = NULL; // already unlinked
+        sregion_release(child);
+    }
+    if (region->parent != NULL) {
+        if (region->prev_sibling != NULL)
+            region->prev_sibling->next_sibling = region->next_sibling;
+        else
+            region->parent->children = region->next_sibling;
+        if (region->next_sibling != NULL)
+            region->next_sibling->prev_sibling = region->prev_sibling;
+    }
+    // the region header lives in one of the chunks, so read the list before freeing anything
+    RegionChunk *chunk = region->chunks;
+    while (chunk != NULL) {
+        RegionChunk *next = chunk->next;
+        sfree(chunk);
+        chunk = next;
+    }
+}
+
 size_t _num_free_blocks() {
     return Heap.num_free_blocks;
 }
@@ -680,3 +993,7 @@ size_t _num_meta_data_bytes() {
 size_t _size_meta_data() {
     return sizeof(MallocMetadata);
 }
+
+size_t _num_purged_bytes() {
+    return Heap.num_purged_bytes;
+}
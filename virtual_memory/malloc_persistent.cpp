@@ -0,0 +1,506 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A variant of the malloc_3 heap that lives inside a memory-mapped file.
+// All links are offsets from the start of the mapping instead of raw pointers, so the file can be
+// mapped at any address in a later run and used as is, without any deserialisation.
+// Offset 0 is the file header, so 0 doubles as the "no block" value.
+
+#define SIZE_LIMIT 1e8 // pow(10, 8)
+#define SPLIT_THRESHOLD 128
+#define PHEAP_MAGIC 0x50414548434f4c4cULL // "LLOCHEAP"
+#define PHEAP_VERSION 2 // 2: top, last, free_head and dirty are no longer checksummed
+#define PHEAP_MIN_CAPACITY (64 * 1024)
+
+bool pheap_open(const char *path, size_t capacity);
+void pheap_close();
+void *pmalloc(size_t size);
+void *pcalloc(size_t num, size_t size);
+void pfree(void *p);
+size_t pheap_offset(void *p);
+void *pheap_pointer(size_t offset);
+void pheap_set_root(void *p);
+void *pheap_root();
+size_t _pnum_free_blocks();
+size_t _pnum_free_bytes();
+size_t _pnum_allocated_blocks();
+size_t _pnum_allocated_bytes();
+size_t _pnum_meta_data_bytes();
+size_t _psize_meta_data();
+
+// Persistent part. Lives at offset 0 of the file.
+struct PersistentHeader {
+    uint64_t magic;
+    uint32_t version;
+    int32_t cookie;    // cookie of every block in this file, fixed when the file is created
+    size_t capacity;   // size of the file and of the mapping
+    size_t top;        // end of the carved area, blocks live in [sizeof(header), top)
+    size_t last;       // block that ends at top (0 while the heap is empty)
+    size_t free_head;  // size sorted list of the free blocks (smallest first)
+    size_t root;       // user entry point into the persisted data
+    uint32_t dirty;    // set while mapped, cleared by a clean pheap_close
+    uint32_t checksum; // of the fields that only change with the header sealed, see headerChecksum
+};
+
+struct PersistentMetadata {
+    int32_t cookie;
+    size_t size;      // payload size, not including the metadata
+    size_t prev_size; // payload size of the block right before this one (0 for the first block)
+    bool is_free;
+    size_t next;      // offsets of the neighbours in the free list
+    size_t prev;
+};
+
+// Volatile part. Only valid for the current mapping and rebuilt lazily after every open.
+struct PersistentHeap {
+    char *base = NULL;
+    PersistentHeader *header = NULL;
+    int fd = -1;
+
+    bool free_list_valid = false; // false after reopening a file that was not closed cleanly
+    bool stats_valid = false;
+
+    size_t num_free_blocks = 0;
+    size_t num_free_bytes = 0;
+
+    size_t num_allocated_blocks = 0;
+    size_t num_allocated_bytes = 0;
+
+    size_t num_meta_data_bytes = 0;
+};
+
+static PersistentHeap PHeap;
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// FNV-1a over the identity of the file and its root. top, last, free_head and dirty change with every
+// pmalloc/pfree and are left out, so a heap that was not closed cleanly still opens; they are checked
+// against the bounds of the file on open and rebuilt from the blocks themselves (see rebuildCaches).
+static uint32_t headerChecksum(const PersistentHeader *header) {
+    uint32_t hash = 2166136261u;
+    hash = fnv1a(hash, header, offsetof(PersistentHeader, top));
+    hash = fnv1a(hash, &header->root, sizeof(header->root));
+    return hash;
+}
+
+static void sealHeader() {
+    PHeap.header->checksum = headerChecksum(PHeap.header);
+    msync(PHeap.base, sizeof(PersistentHeader), MS_ASYNC);
+}
+
+static inline PersistentMetadata *block(size_t offset) {
+    return offset == 0 ? NULL : (PersistentMetadata *)(PHeap.base + offset);
+}
+
+static inline size_t offsetOf(PersistentMetadata *meta) {
+    return meta == NULL ? 0 : (size_t)((char *)meta - PHeap.base);
+}
+
+static inline size_t firstBlock() {
+    return sizeof(PersistentHeader);
+}
+
+static inline size_t nextPhysical(PersistentMetadata *meta) {
+    return offsetOf(meta) + sizeof(PersistentMetadata) + meta->size;
+}
+
+// Validate that the cookie did not change. exit if does. Same policy as malloc_3.
+static void validateCookie(PersistentMetadata *meta) {
+    if (meta != NULL && meta->cookie != PHeap.header->cookie) {
+        exit(0xdeadbeef);
+    }
+}
+
+// List Insert (sorted by size, then by address)
+static void freeListInsert(PersistentMetadata *meta) {
+    size_t offset = offsetOf(meta);
+    size_t prev = 0;
+    size_t curr = PHeap.header->free_head;
+    while (curr != 0) {
+        PersistentMetadata *curr_meta = block(curr);
+        validateCookie(curr_meta);
+        if (curr_meta->size > meta->size || (curr_meta->size == meta->size && curr > offset))
+            break;
+        prev = curr;
+        curr = curr_meta->next;
+    }
+    meta->prev = prev;
+    meta->next = curr;
+    if (curr != 0)
+        block(curr)->prev = offset;
+    if (prev != 0)
+        block(prev)->next = offset;
+    else
+        PHeap.header->free_head = offset;
+}
+
+// List Remove
+static void freeListRemove(PersistentMetadata *meta) {
+    if (meta->prev != 0)
+        block(meta->prev)->next = meta->next;
+    else
+        PHeap.header->free_head = meta->next;
+    if (meta->next != 0)
+        block(meta->next)->prev = meta->prev;
+    meta->next = 0;
+    meta->prev = 0;
+}
+
+// Walk all the blocks once, validating them and rebuilding the volatile caches.
+// The free list is rebuilt as well when the file was not closed cleanly, since a crash in the
+// middle of a list update could have left it half linked (the blocks themselves are the truth).
+// So are last and the prev_size links, which a crash in the middle of a merge could leave stale.
+static void rebuildCaches() {
+    bool rebuild_list = !PHeap.free_list_valid;
+    if (rebuild_list)
+        PHeap.header->free_head = 0;
+    size_t last = 0;
+    size_t prev_size = 0;
+
+    PHeap.num_free_blocks = 0;
+    PHeap.num_free_bytes = 0;
+    PHeap.num_allocated_blocks = 0;
+    PHeap.num_allocated_bytes = 0;
+    PHeap.num_meta_data_bytes = 0;
+
+    size_t offset = firstBlock();
+    while (offset < PHeap.header->top) {
+        PersistentMetadata *meta = block(offset);
+        validateCookie(meta);
+        if (rebuild_list)
+            meta->prev_size = prev_size;
+        if (meta->is_free) {
+            PHeap.num_free_blocks += 1;
+            PHeap.num_free_bytes += meta->size;
+            if (rebuild_list)
+                freeListInsert(meta);
+        }
+        PHeap.num_allocated_blocks += 1;
+        PHeap.num_allocated_bytes += meta->size;
+        PHeap.num_meta_data_bytes += sizeof(PersistentMetadata);
+        last = offset;
+        prev_size = meta->size;
+        offset = nextPhysical(meta);
+    }
+    if (offset != PHeap.header->top)
+        exit(0xdeadbeef);
+    if (rebuild_list)
+        PHeap.header->last = last;
+
+    PHeap.free_list_valid = true;
+    PHeap.stats_valid = true;
+}
+
+static inline void ensureCaches() {
+    if (!PHeap.free_list_valid || !PHeap.stats_valid)
+        rebuildCaches();
+}
+
+// The sealed fields must match their checksum; the others only have to point inside the carved area.
+// last and free_head of a heap that was not closed cleanly are not used before they are rebuilt.
+static bool validateHeader(const PersistentHeader *header, size_t file_size) {
+    return header->magic == PHEAP_MAGIC && header->version == PHEAP_VERSION &&
+           header->checksum == headerChecksum(header) && header->capacity == file_size &&
+           header->top >= sizeof(PersistentHeader) && header->top <= header->capacity &&
+           header->root < header->top &&
+           (header->dirty != 0 || (header->last < header->top && header->free_head < header->top));
+}
+
+// Map the heap stored at path, creating it with the given capacity if the file does not exist.
+// Only the header is checked here; blocks are validated on the first access that needs them.
+bool pheap_open(const char *path, size_t capacity) {
+    if (PHeap.base != NULL)
+        return false;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+
+    bool created = st.st_size == 0;
+    size_t size = created ? capacity : (size_t)st.st_size;
+    if (created) {
+        if (capacity < PHEAP_MIN_CAPACITY || ftruncate(fd, capacity) < 0) {
+            close(fd);
+            return false;
+        }
+    }
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    PersistentHeader *header = (PersistentHeader *)base;
+
+    if (created) {
+        int32_t cookie;
+        if (getrandom(&cookie, sizeof(cookie), GRND_NONBLOCK) != (ssize_t)sizeof(cookie))
+            cookie = (int32_t)((uintptr_t)base ^ (uintptr_t)getpid());
+        header->magic = PHEAP_MAGIC;
+        header->version = PHEAP_VERSION;
+        header->cookie = cookie;
+        header->capacity = size;
+        header->top = sizeof(PersistentHeader);
+        header->last = 0;
+        header->free_head = 0;
+        header->root = 0;
+        header->dirty = 0;
+    } else if (size < sizeof(PersistentHeader) || !validateHeader(header, size)) {
+        munmap(base, size);
+        close(fd);
+        return false;
+    }
+
+    PHeap.base = (char *)base;
+    PHeap.header = header;
+    PHeap.fd = fd;
+    PHeap.free_list_valid = created || header->dirty == 0;
+    PHeap.stats_valid = created;
+    PHeap.num_free_blocks = 0;
+    PHeap.num_free_bytes = 0;
+    PHeap.num_allocated_blocks = 0;
+    PHeap.num_allocated_bytes = 0;
+    PHeap.num_meta_data_bytes = 0;
+
+    header->dirty = 1;
+    sealHeader();
+    return true;
+}
+
+// Flush and unmap. A heap closed this way reopens without rebuilding its free list.
+void pheap_close() {
+    if (PHeap.base == NULL)
+        return;
+    size_t capacity = PHeap.header->capacity;
+    PHeap.header->dirty = 0;
+    sealHeader();
+    msync(PHeap.base, capacity, MS_SYNC);
+    munmap(PHeap.base, capacity);
+    close(PHeap.fd);
+    PHeap.base = NULL;
+    PHeap.header = NULL;
+    PHeap.fd = -1;
+    PHeap.free_list_valid = false;
+    PHeap.stats_valid = false;
+}
+
+// splits a free block, leaving the tail of it as a new free block when it is big enough
+static void split(PersistentMetadata *meta, size_t new_size) {
+    if (meta->size < new_size + sizeof(PersistentMetadata) + SPLIT_THRESHOLD)
+        return;
+
+    size_t tail_offset = offsetOf(meta) + sizeof(PersistentMetadata) + new_size;
+    PersistentMetadata *tail = block(tail_offset);
+    tail->cookie = PHeap.header->cookie;
+    tail->size = meta->size - new_size - sizeof(PersistentMetadata);
+    tail->prev_size = new_size;
+    tail->is_free = true;
+    meta->size = new_size;
+
+    size_t after = nextPhysical(tail);
+    if (after < PHeap.header->top)
+        block(after)->prev_size = tail->size;
+    else
+        PHeap.header->last = tail_offset;
+
+    freeListInsert(tail);
+    PHeap.num_free_blocks += 1;
+    PHeap.num_free_bytes += tail->size;
+    PHeap.num_allocated_blocks += 1;
+    PHeap.num_allocated_bytes -= sizeof(PersistentMetadata);
+    PHeap.num_meta_data_bytes += sizeof(PersistentMetadata);
+}
+
+void *pmalloc(size_t size) {
+    if (PHeap.base == NULL || size == 0 || size > SIZE_LIMIT)
+        return NULL;
+    ensureCaches();
+
+    // best fit, the free list is sorted by size
+    size_t offset = PHeap.header->free_head;
+    while (offset != 0) {
+        PersistentMetadata *meta = block(offset);
+        validateCookie(meta);
+        if (meta->size >= size) {
+            freeListRemove(meta);
+            meta->is_free = false;
+            PHeap.num_free_blocks -= 1;
+            PHeap.num_free_bytes -= meta->size;
+            split(meta, size);
+            return (void *)(meta + 1);
+        }
+        offset = meta->next;
+    }
+
+    // carve a new block from the untouched end of the file
+    size_t top = PHeap.header->top;
+    if (PHeap.header->capacity - top < sizeof(PersistentMetadata) + size)
+        return NULL;
+    PersistentMetadata *meta = block(top);
+    meta->cookie = PHeap.header->cookie;
+    meta->size = size;
+    meta->is_free = false;
+    meta->next = 0;
+    meta->prev = 0;
+    meta->prev_size = PHeap.header->last == 0 ? 0 : block(PHeap.header->last)->size;
+    PHeap.header->top = top + sizeof(PersistentMetadata) + size;
+    PHeap.header->last = top;
+
+    PHeap.num_allocated_blocks += 1;
+    PHeap.num_allocated_bytes += size;
+    PHeap.num_meta_data_bytes += sizeof(PersistentMetadata);
+    return (void *)(meta + 1);
+}
+
+void *pcalloc(size_t num, size_t size) {
+    if (size != 0 && num > SIZE_LIMIT / size)
+        return NULL;
+    void *address = pmalloc(num * size);
+    if (address == NULL)
+        return NULL;
+    memset(address, 0, num * size);
+    return address;
+}
+
+// frees a block and merges it with its free physical neighbours
+void pfree(void *p) {
+    if (p == NULL || PHeap.base == NULL)
+        return;
+    ensureCaches();
+    PersistentMetadata *meta = (PersistentMetadata *)p - 1;
+    validateCookie(meta);
+    if (meta->is_free)
+        return;
+
+    meta->is_free = true;
+    PHeap.num_free_blocks += 1;
+    PHeap.num_free_bytes += meta->size;
+
+    // merge with the higher neighbour
+    size_t next = nextPhysical(meta);
+    if (next < PHeap.header->top) {
+        PersistentMetadata *next_meta = block(next);
+        validateCookie(next_meta);
+        if (next_meta->is_free) {
+            freeListRemove(next_meta);
+            if (PHeap.header->last == next)
+                PHeap.header->last = offsetOf(meta);
+            meta->size += next_meta->size + sizeof(PersistentMetadata);
+            PHeap.num_free_blocks -= 1;
+            PHeap.num_free_bytes += sizeof(PersistentMetadata);
+            PHeap.num_allocated_blocks -= 1;
+            PHeap.num_allocated_bytes += sizeof(PersistentMetadata);
+            PHeap.num_meta_data_bytes -= sizeof(PersistentMetadata);
+        }
+    }
+
+    // merge with the lower neighbour
+    if (offsetOf(meta) != firstBlock()) {
+        PersistentMetadata *prev_meta = block(offsetOf(meta) - meta->prev_size - sizeof(PersistentMetadata));
+        validateCookie(prev_meta);
+        if (prev_meta->is_free) {
+            freeListRemove(prev_meta);
+            if (PHeap.header->last == offsetOf(meta))
+                PHeap.header->last = offsetOf(prev_meta);
+            prev_meta->size += meta->size + sizeof(PersistentMetadata);
+            PHeap.num_free_blocks -= 1;
+            PHeap.num_free_bytes += sizeof(PersistentMetadata);
+            PHeap.num_allocated_blocks -= 1;
+            PHeap.num_allocated_bytes += sizeof(PersistentMetadata);
+            PHeap.num_meta_data_bytes -= sizeof(PersistentMetadata);
+            meta = prev_meta;
+        }
+    }
+
+    size_t after = nextPhysical(meta);
+    if (after < PHeap.header->top)
+        block(after)->prev_size = meta->size;
+    freeListInsert(meta);
+}
+
+// Pointers are only valid for the current mapping; store offsets inside the heap instead.
+// Returns 0 for a pointer outside the carved area of the heap.
+size_t pheap_offset(void *p) {
+    if (p == NULL || PHeap.base == NULL)
+        return 0;
+    if ((char *)p < PHeap.base + firstBlock() || (char *)p >= PHeap.base + PHeap.header->top)
+        return 0;
+    return (size_t)((char *)p - PHeap.base);
+}
+
+void *pheap_pointer(size_t offset) {
+    if (offset == 0 || PHeap.base == NULL || offset >= PHeap.header->top)
+        return NULL;
+    return (void *)(PHeap.base + offset);
+}
+
+// The root is how a reopened heap finds its data again (e.g. the top of a persisted index).
+void pheap_set_root(void *p) {
+    if (PHeap.base == NULL)
+        return;
+    PHeap.header->root = pheap_offset(p);
+    sealHeader();
+}
+
+void *pheap_root() {
+    if (PHeap.base == NULL)
+        return NULL;
+    return pheap_pointer(PHeap.header->root);
+}
+
+size_t _pnum_free_blocks() {
+    if (PHeap.base == NULL)
+        return 0;
+    ensureCaches();
+    return PHeap.num_free_blocks;
+}
+
+size_t _pnum_free_bytes() {
+    if (PHeap.base == NULL)
+        return 0;
+    ensureCaches();
+    return PHeap.num_free_bytes;
+}
+
+size_t _pnum_allocated_blocks() {
+    if (PHeap.base == NULL)
+        return 0;
+    ensureCaches();
+    return PHeap.num_allocated_blocks;
+}
+
+size_t _pnum_allocated_bytes() {
+    if (PHeap.base == NULL)
+        return 0;
+    ensureCaches();
+    return PHeap.num_allocated_bytes;
+}
+
+size_t _pnum_meta_data_bytes() {
+    if (PHeap.base == NULL)
+        return 0;
+    ensureCaches();
+    return PHeap.num_meta_data_bytes;
+}
+
+size_t _psize_meta_data() {
+    return sizeof(PersistentMetadata);
+}
@@ -0,0 +1,224 @@
+#ifndef OBJECT_POOL_H_
+#define OBJECT_POOL_H_
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <pthread.h>
+#include <stdint.h>
+#include <utility>
+
+// Fixed size object pools on top of malloc_3 (link with malloc_3.cpp).
+// Objects of one size are carved from big slabs and recycled through a free stack, so there is no
+// per object metadata and no split/merge work. Each thread keeps a small cache of free objects and
+// only touches the shared (locked) pool to refill or drain it in batches. malloc_3 takes its own heap
+// lock, so slabs, free stacks and PoolAllocator's array allocations can come from any thread.
+//
+// Slabs and free stacks are big enough to be mmapped by malloc_3, so the pools never move the program
+// break. malloc_3's sbrk heap assumes nobody else does (it walks it block by block up to sbrk(0)), and
+// the pools can be used next to the glibc heap or a PolicyAllocator. Only PoolAllocator's array
+// allocations (n != 1) can land on the sbrk heap.
+//
+// The free stack is an array of pointers kept apart from the slabs: allocating and freeing never
+// write into the objects themselves, so after fork() a child that only allocates and frees copies
+// the few pages holding the stack rather than one page per object it touches.
+//
+// ObjectPool<T>    - create()/destroy() for callers that manage objects directly.
+// PoolAllocator<T> - STL allocator, e.g. std::map<K, V, std::less<K>, PoolAllocator<std::pair<const K, V>>>.
+
+void *smalloc(size_t size);
+void sfree(void *p);
+
+#define POOL_SLAB_SIZE (256 * 1024) // above MMAP_THRESHOLD, so a slab never touches the sbrk heap
+                                    // (plus up to Align - 1 bytes for aligning the first object,
+                                    // and at least one object however big it is)
+#define POOL_CACHE_SIZE 64          // free objects kept per thread (and per object size)
+#define POOL_BATCH_SIZE (POOL_CACHE_SIZE / 2)
+#define POOL_STACK_MIN_CAPACITY (128 * 1024 / sizeof(void *)) // MMAP_THRESHOLD bytes of pointers
+
+// Shared pool of all objects of one (size, alignment) class.
+template <size_t Size, size_t Align> class FixedSizePool {
+  public:
+    static constexpr size_t ObjectSize =
+        ((Size < sizeof(void *) ? sizeof(void *) : Size) + Align - 1) / Align * Align;
+    // an object bigger than POOL_SLAB_SIZE gets a slab of its own
+    static constexpr size_t SlabSize = ObjectSize > POOL_SLAB_SIZE ? ObjectSize : POOL_SLAB_SIZE;
+
+    static FixedSizePool &instance() {
+        static FixedSizePool pool;
+        return pool;
+    }
+
+    void *allocate() {
+        ThreadCache &cache = threadCache();
+        if (cache.count == 0 && !refill(cache))
+            return NULL;
+        return cache.items[--cache.count];
+    }
+
+    void deallocate(void *p) {
+        if (p == NULL)
+            return;
+        ThreadCache &cache = threadCache();
+        if (cache.count == POOL_CACHE_SIZE)
+            drain(cache, POOL_BATCH_SIZE);
+        cache.items[cache.count++] = p;
+    }
+
+  private:
+    // Growable array of pointers, kept in its own smalloc block instead of inside the objects.
+    struct PointerStack {
+        void **items = NULL;
+        size_t count = 0;
+        size_t capacity = 0;
+
+        bool reserve(size_t wanted) {
+            if (wanted <= capacity)
+                return true;
+            size_t grown = capacity == 0 ? POOL_STACK_MIN_CAPACITY : capacity;
+            while (grown < wanted)
+                grown *= 2;
+            void **bigger = (void **)smalloc(grown * sizeof(void *));
+            if (bigger == NULL)
+                return false;
+            for (size_t i = 0; i < count; i++)
+                bigger[i] = items[i];
+            sfree(items);
+            items = bigger;
+            capacity = grown;
+            return true;
+        }
+    };
+
+    struct ThreadCache {
+        void *items[POOL_CACHE_SIZE];
+        size_t count = 0;
+        ~ThreadCache() {
+            // return everything to the shared pool when the thread exits
+            instance().drain(*this, count);
+        }
+    };
+
+    static ThreadCache &threadCache() {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    FixedSizePool() {
+        pthread_atfork(prepareFork, releaseFork, releaseFork);
+    }
+    FixedSizePool(const FixedSizePool &) = delete;
+    FixedSizePool &operator=(const FixedSizePool &) = delete;
+
+    // Hold the pool lock across fork(), so the child never starts with it taken by a thread that was
+    // not copied. Objects in the caches of those other threads are simply lost to the child.
+    static void prepareFork() {
+        instance().lock.lock();
+    }
+    static void releaseFork() {
+        instance().lock.unlock();
+    }
+
+    // caller holds the lock. Returns false unless it added at least one free object.
+    bool grow() {
+        size_t per_slab = SlabSize / ObjectSize;
+        if (per_slab == 0)
+            return false;
+        // every object ever carved has a slot in free_stack, so drain() can always push
+        if (!free_stack.reserve(objects + per_slab) || !slabs.reserve(slabs.count + 1))
+            return false;
+        char *slab = (char *)smalloc(SlabSize + Align - 1);
+        if (slab == NULL)
+            return false;
+        slabs.items[slabs.count++] = slab;
+        objects += per_slab;
+        // smalloc only guarantees 8 byte alignment, so align the address of the first object
+        char *first = (char *)(((uintptr_t)slab + Align - 1) / Align * Align);
+        // pushed from the end, so the lowest addresses are handed out first
+        for (size_t i = per_slab; i-- > 0;)
+            free_stack.items[free_stack.count++] = first + i * ObjectSize;
+        return true;
+    }
+
+    bool refill(ThreadCache &cache) {
+        std::lock_guard<std::mutex> guard(lock);
+        while (cache.count < POOL_BATCH_SIZE) {
+            if (free_stack.count == 0 && !grow())
+                break;
+            cache.items[cache.count++] = free_stack.items[--free_stack.count];
+        }
+        return cache.count > 0;
+    }
+
+    void drain(ThreadCache &cache, size_t amount) {
+        std::lock_guard<std::mutex> guard(lock);
+        while (amount-- > 0 && cache.count > 0)
+            free_stack.items[free_stack.count++] = cache.items[--cache.count];
+    }
+
+    std::mutex lock;
+    PointerStack free_stack;
+    PointerStack slabs; // slabs are kept for the life of the process
+    size_t objects = 0;
+};
+
+template <class T> class ObjectPool {
+  public:
+    template <class... Args> static T *create(Args &&...args) {
+        void *memory = Pool::instance().allocate();
+        if (memory == NULL)
+            throw std::bad_alloc();
+        try {
+            return new (memory) T(std::forward<Args>(args)...);
+        } catch (...) {
+            Pool::instance().deallocate(memory);
+            throw;
+        }
+    }
+
+    static void destroy(T *object) {
+        if (object == NULL)
+            return;
+        object->~T();
+        Pool::instance().deallocate(object);
+    }
+
+  private:
+    typedef FixedSizePool<sizeof(T), alignof(T)> Pool;
+};
+
+template <class T> class PoolAllocator {
+  public:
+    typedef T value_type;
+
+    PoolAllocator() noexcept = default;
+    template <class U> PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+    T *allocate(size_t n) {
+        // node based containers allocate one object at a time; anything else goes straight to smalloc
+        void *memory = n == 1 ? Pool::instance().allocate() : smalloc(n * sizeof(T));
+        if (memory == NULL)
+            throw std::bad_alloc();
+        return (T *)memory;
+    }
+
+    void deallocate(T *p, size_t n) {
+        if (n == 1)
+            Pool::instance().deallocate(p);
+        else
+            sfree(p);
+    }
+
+  private:
+    typedef FixedSizePool<sizeof(T), alignof(T)> Pool;
+};
+
+template <class T, class U> bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) {
+    return true;
+}
+
+template <class T, class U> bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) {
+    return false;
+}
+
+#endif // OBJECT_POOL_H_
@@ -0,0 +1,466 @@
+#ifndef POLICY_ALLOCATOR_H_
+#define POLICY_ALLOCATOR_H_
+
+#include <mutex>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// One allocator, four compile-time policies. malloc_1, malloc_2 and malloc_3 are three points of the
+// same design space, and any other combination can be instantiated and benchmarked next to them (see
+// bench_policy.cpp). Every policy call is resolved at compile time.
+//
+// malloc_1.cpp and malloc_2.cpp are instantiations: their smalloc/sfree/_num_* functions forward to
+// BumpAllocator and FirstFitAllocator. malloc_3.cpp keeps its own implementation (cookies, safe
+// linking, the size ordered free list and the regions live in its block layout); SplitMergeAllocator
+// models its placement and coalescing policies only.
+//
+//  Placement    - which free block serves a request: BumpPlacement (a bare sbrk per request, blocks
+//                 have no metadata and are never freed or resized, exactly malloc_1; the other
+//                 policies do not apply to it), FirstFitPlacement (lowest address, malloc_2),
+//                 BestFitPlacement (smallest, malloc_3).
+//  Coalescing   - NoCoalescing, or SplitMergeCoalescing<threshold> (split, merge neighbours, grow the
+//                 wilderness in place, like malloc_3).
+//  LargeObjects - NoLargeObjects, or MmapLargeObjects<threshold> (one mapping per big block).
+//  Locking      - NoLocking, or MutexLocking for use from several threads (safe across fork()).
+//
+// Blocks taken with sbrk are kept in one address ordered list. Two neighbours in that list are only
+// merged when they are really adjacent, so a PolicyAllocator copes with other users of sbrk (several
+// PolicyAllocators, the glibc heap). The reverse does not hold: malloc_3 assumes it owns the program
+// break and walks its heap block by block up to sbrk(0), so a PolicyAllocator block between two of
+// its blocks fails its cookie check and exits the process. Do not take small (sbrk) blocks from a
+// PolicyAllocator in a process that also takes small blocks from malloc_3.
+
+#define POLICY_SIZE_LIMIT 1e8 // pow(10, 8)
+
+struct PolicyBlock {
+    size_t size; // payload size, not including the metadata
+    bool is_free;
+    bool is_mapped;
+    PolicyBlock *next; // address order (sbrk blocks) or mapping list (mapped blocks)
+    PolicyBlock *prev;
+};
+
+struct PolicyHeap {
+    PolicyBlock *first = NULL;
+    PolicyBlock *last = NULL;
+    PolicyBlock *mapped = NULL;
+
+    size_t num_free_blocks = 0;
+    size_t num_free_bytes = 0;
+
+    size_t num_allocated_blocks = 0;
+    size_t num_allocated_bytes = 0;
+
+    size_t num_meta_data_bytes = 0;
+};
+
+static inline bool policyAdjacent(PolicyBlock *low, PolicyBlock *high) {
+    return low != NULL && high != NULL && (char *)(low + 1) + low->size == (char *)high;
+}
+
+// ---------------------------------------------------------------- placement
+
+struct BumpPlacement {
+    static const bool has_metadata = false;
+    static PolicyBlock *find(PolicyHeap &, size_t) {
+        return NULL;
+    }
+};
+
+struct FirstFitPlacement {
+    static const bool has_metadata = true;
+    static PolicyBlock *find(PolicyHeap &heap, size_t size) {
+        for (PolicyBlock *block = heap.first; block != NULL; block = block->next) {
+            if (block->is_free && block->size >= size)
+                return block;
+        }
+        return NULL;
+    }
+};
+
+struct BestFitPlacement {
+    static const bool has_metadata = true;
+    static PolicyBlock *find(PolicyHeap &heap, size_t size) {
+        PolicyBlock *best = NULL;
+        for (PolicyBlock *block = heap.first; block != NULL; block = block->next) {
+            if (block->is_free && block->size >= size && (best == NULL || block->size < best->size)) {
+                best = block;
+                if (best->size == size)
+                    break;
+            }
+        }
+        return best;
+    }
+};
+
+// ---------------------------------------------------------------- coalescing
+
+struct NoCoalescing {
+    static void split(PolicyHeap &, PolicyBlock *, size_t) {}
+    static PolicyBlock *merge(PolicyHeap &, PolicyBlock *block) {
+        return block;
+    }
+    static bool growInPlace(PolicyHeap &, PolicyBlock *, size_t) {
+        return false;
+    }
+    static PolicyBlock *extendWilderness(PolicyHeap &, size_t) {
+        return NULL;
+    }
+};
+
+template <size_t SplitThreshold = 128> struct SplitMergeCoalescing {
+    // leave the tail of an allocated block as a new free block when it is big enough
+    static void split(PolicyHeap &heap, PolicyBlock *block, size_t size) {
+        if (block->size < size + sizeof(PolicyBlock) + SplitThreshold)
+            return;
+        PolicyBlock *tail = (PolicyBlock *)((char *)(block + 1) + size);
+        tail->size = block->size - size - sizeof(PolicyBlock);
+        tail->is_free = true;
+        tail->is_mapped = false;
+        tail->prev = block;
+        tail->next = block->next;
+        if (block->next != NULL)
+            block->next->prev = tail;
+        else
+            heap.last = tail;
+        block->next = tail;
+        block->size = size;
+
+        heap.num_free_blocks += 1;
+        heap.num_free_bytes += tail->size;
+        heap.num_allocated_blocks += 1;
+        heap.num_allocated_bytes -= sizeof(PolicyBlock);
+        heap.num_meta_data_bytes += sizeof(PolicyBlock);
+        merge(heap, tail);
+    }
+
+    // merge a free block with its free neighbours, returns the merged block
+    static PolicyBlock *merge(PolicyHeap &heap, PolicyBlock *block) {
+        if (block->next != NULL && block->next->is_free && policyAdjacent(block, block->next))
+            absorbNext(heap, block);
+        if (block->prev != NULL && block->prev->is_free && policyAdjacent(block->prev, block)) {
+            block = block->prev;
+            absorbNext(heap, block);
+        }
+        return block;
+    }
+
+    // grow an allocated block by taking (part of) the free block right after it
+    static bool growInPlace(PolicyHeap &heap, PolicyBlock *block, size_t size) {
+        PolicyBlock *next = block->next;
+        if (next == NULL || !next->is_free || !policyAdjacent(block, next) ||
+            block->size + sizeof(PolicyBlock) + next->size < size)
+            return false;
+        heap.num_free_blocks -= 1;
+        heap.num_free_bytes -= next->size;
+        heap.num_allocated_blocks -= 1;
+        heap.num_allocated_bytes += sizeof(PolicyBlock);
+        heap.num_meta_data_bytes -= sizeof(PolicyBlock);
+        block->size += sizeof(PolicyBlock) + next->size;
+        unlink(heap, next);
+        split(heap, block, size);
+        return true;
+    }
+
+    // enlarge the last block with sbrk if it is free and nobody else moved the break since
+    static PolicyBlock *extendWilderness(PolicyHeap &heap, size_t size) {
+        PolicyBlock *last = heap.last;
+        if (last == NULL || !last->is_free || (char *)(last + 1) + last->size != sbrk(0))
+            return NULL;
+        if (size > last->size && sbrk(size - last->size) == (void *)-1)
+            return NULL;
+        heap.num_free_blocks -= 1;
+        heap.num_free_bytes -= last->size;
+        if (size > last->size) {
+            heap.num_allocated_bytes += size - last->size;
+            last->size = size;
+        }
+        last->is_free = false;
+        return last;
+    }
+
+  private:
+    static void absorbNext(PolicyHeap &heap, PolicyBlock *block) {
+        PolicyBlock *next = block->next;
+        block->size += sizeof(PolicyBlock) + next->size;
+        unlink(heap, next);
+        heap.num_free_blocks -= 1;
+        heap.num_free_bytes += sizeof(PolicyBlock);
+        heap.num_allocated_blocks -= 1;
+        heap.num_allocated_bytes += sizeof(PolicyBlock);
+        heap.num_meta_data_bytes -= sizeof(PolicyBlock);
+    }
+
+    static void unlink(PolicyHeap &heap, PolicyBlock *block) {
+        if (block->prev != NULL)
+            block->prev->next = block->next;
+        else
+            heap.first = block->next;
+        if (block->next != NULL)
+            block->next->prev = block->prev;
+        else
+            heap.last = block->prev;
+    }
+};
+
+// ---------------------------------------------------------------- large objects
+
+struct NoLargeObjects {
+    static bool handles(size_t) {
+        return false;
+    }
+};
+
+template <size_t Threshold = 128 * 1024> struct MmapLargeObjects {
+    static bool handles(size_t size) {
+        return size >= Threshold;
+    }
+};
+
+// ---------------------------------------------------------------- locking
+
+struct NoLocking {
+    void lock() {}
+    void unlock() {}
+};
+
+// A mutex that is safe across fork(). All live instances are linked together; a pthread_atfork
+// prepare handler takes every one of them (so no other thread is half way through a heap update at
+// the moment of the fork) and both parent and child release them afterwards. Without it a child
+// forked while another thread held the lock would inherit a lock nobody is left to release.
+class MutexLocking {
+  public:
+    MutexLocking() {
+        static bool registered = (pthread_atfork(prepareFork, releaseFork, releaseFork), true);
+        (void)registered;
+        std::lock_guard<std::mutex> guard(registryLock());
+        next = registry();
+        prev = NULL;
+        if (next != NULL)
+            next->prev = this;
+        registry() = this;
+    }
+
+    ~MutexLocking() {
+        std::lock_guard<std::mutex> guard(registryLock());
+        if (prev != NULL)
+            prev->next = next;
+        else
+            registry() = next;
+        if (next != NULL)
+            next->prev = prev;
+    }
+
+    MutexLocking(const MutexLocking &) = delete;
+    MutexLocking &operator=(const MutexLocking &) = delete;
+
+    void lock() {
+        mutex.lock();
+    }
+    void unlock() {
+        mutex.unlock();
+    }
+
+  private:
+    static std::mutex &registryLock() {
+        static std::mutex lock;
+        return lock;
+    }
+    static MutexLocking *&registry() {
+        static MutexLocking *head = NULL;
+        return head;
+    }
+
+    // the registry lock is taken first and released last, so no instance comes or goes in between
+    static void prepareFork() {
+        registryLock().lock();
+        for (MutexLocking *instance = registry(); instance != NULL; instance = instance->next)
+            instance->mutex.lock();
+    }
+    static void releaseFork() {
+        for (MutexLocking *instance = registry(); instance != NULL; instance = instance->next)
+            instance->mutex.unlock();
+        registryLock().unlock();
+    }
+
+    std::mutex mutex;
+    MutexLocking *next;
+    MutexLocking *prev;
+};
+
+// ---------------------------------------------------------------- allocator
+
+template <class Placement, class Coalescing, class LargeObjects, class Locking> class PolicyAllocator {
+  public:
+    // false for BumpPlacement: a block does not know its size, so it cannot be reallocated
+    static const bool resizable = Placement::has_metadata;
+
+    void *allocate(size_t size) {
+        if (size == 0 || size > POLICY_SIZE_LIMIT)
+            return NULL;
+        std::lock_guard<Locking> guard(lock);
+        return allocateLocked(size);
+    }
+
+    void *callocate(size_t num, size_t size) {
+        if (size != 0 && num > (size_t)POLICY_SIZE_LIMIT / size) // num * size would overflow or be refused
+            return NULL;
+        void *address = allocate(num * size);
+        if (address == NULL)
+            return NULL;
+        memset(address, 0, num * size);
+        return address;
+    }
+
+    void deallocate(void *p) {
+        if (p == NULL || !Placement::has_metadata)
+            return;
+        std::lock_guard<Locking> guard(lock);
+        deallocateLocked((PolicyBlock *)p - 1);
+    }
+
+    void *reallocate(void *oldp, size_t size) {
+        static_assert(resizable, "blocks without metadata cannot be reallocated (malloc_1 has no srealloc)");
+        if (oldp == NULL)
+            return allocate(size);
+        if (size == 0 || size > POLICY_SIZE_LIMIT)
+            return NULL;
+        std::lock_guard<Locking> guard(lock);
+        PolicyBlock *block = (PolicyBlock *)oldp - 1;
+        if (!block->is_mapped) {
+            if (block->size >= size) {
+                Coalescing::split(heap, block, size);
+                return oldp;
+            }
+            if (Coalescing::growInPlace(heap, block, size))
+                return oldp;
+        } else if (block->size == size) {
+            return oldp;
+        }
+        void *newp = allocateLocked(size);
+        if (newp == NULL)
+            return NULL;
+        memmove(newp, oldp, block->size < size ? block->size : size);
+        deallocateLocked(block);
+        return newp;
+    }
+
+    // statistics, same meaning as the _num_* functions of malloc_2 and malloc_3
+    size_t numFreeBlocks() const {
+        return heap.num_free_blocks;
+    }
+    size_t numFreeBytes() const {
+        return heap.num_free_bytes;
+    }
+    size_t numAllocatedBlocks() const {
+        return heap.num_allocated_blocks;
+    }
+    size_t numAllocatedBytes() const {
+        return heap.num_allocated_bytes;
+    }
+    size_t numMetaDataBytes() const {
+        return heap.num_meta_data_bytes;
+    }
+    static size_t sizeMetaData() {
+        return sizeof(PolicyBlock);
+    }
+
+  private:
+    void *allocateLocked(size_t size) {
+        if (!Placement::has_metadata) {
+            void *address = sbrk(size);
+            return address == (void *)-1 ? NULL : address;
+        }
+        if (LargeObjects::handles(size))
+            return allocateMapped(size);
+
+        PolicyBlock *block = Placement::find(heap, size);
+        if (block != NULL) {
+            block->is_free = false;
+            heap.num_free_blocks -= 1;
+            heap.num_free_bytes -= block->size;
+            Coalescing::split(heap, block, size);
+            return block + 1;
+        }
+        block = Coalescing::extendWilderness(heap, size);
+        if (block != NULL)
+            return block + 1;
+
+        void *address = sbrk(size + sizeof(PolicyBlock));
+        if (address == (void *)-1)
+            return NULL;
+        block = (PolicyBlock *)address;
+        block->size = size;
+        block->is_free = false;
+        block->is_mapped = false;
+        block->next = NULL;
+        block->prev = heap.last;
+        if (heap.last != NULL)
+            heap.last->next = block;
+        else
+            heap.first = block;
+        heap.last = block;
+        newAllocAdjustment(size);
+        return block + 1;
+    }
+
+    void *allocateMapped(size_t size) {
+        void *address =
+            mmap(NULL, size + sizeof(PolicyBlock), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (address == MAP_FAILED)
+            return NULL;
+        PolicyBlock *block = (PolicyBlock *)address;
+        block->size = size;
+        block->is_free = false;
+        block->is_mapped = true;
+        block->prev = NULL;
+        block->next = heap.mapped;
+        if (heap.mapped != NULL)
+            heap.mapped->prev = block;
+        heap.mapped = block;
+        newAllocAdjustment(size);
+        return block + 1;
+    }
+
+    void deallocateLocked(PolicyBlock *block) {
+        if (block->is_mapped) {
+            if (block->prev != NULL)
+                block->prev->next = block->next;
+            else
+                heap.mapped = block->next;
+            if (block->next != NULL)
+                block->next->prev = block->prev;
+            heap.num_allocated_blocks -= 1;
+            heap.num_allocated_bytes -= block->size;
+            heap.num_meta_data_bytes -= sizeof(PolicyBlock);
+            munmap(block, block->size + sizeof(PolicyBlock));
+            return;
+        }
+        if (block->is_free)
+            return;
+        block->is_free = true;
+        heap.num_free_blocks += 1;
+        heap.num_free_bytes += block->size;
+        Coalescing::merge(heap, block);
+    }
+
+    void newAllocAdjustment(size_t size) {
+        heap.num_allocated_blocks += 1;
+        heap.num_allocated_bytes += size;
+        heap.num_meta_data_bytes += sizeof(PolicyBlock);
+    }
+
+    PolicyHeap heap;
+    Locking lock;
+};
+
+// the three variants of this directory
+typedef PolicyAllocator<BumpPlacement, NoCoalescing, NoLargeObjects, NoLocking> BumpAllocator;         // malloc_1
+typedef PolicyAllocator<FirstFitPlacement, NoCoalescing, NoLargeObjects, NoLocking> FirstFitAllocator; // malloc_2
+typedef PolicyAllocator<BestFitPlacement, SplitMergeCoalescing<128>, MmapLargeObjects<128 * 1024>, NoLocking>
+    SplitMergeAllocator; // a model of malloc_3
+
+#endif // POLICY_ALLOCATOR_H_
@@ -0,0 +1,116 @@
+// Test: a persistent heap (malloc_persistent.cpp) that was not closed reopens and recovers.
+//
+// Build and run:
+//  g++ -O2 -std=c++11 test_persistent.cpp malloc_persistent.cpp -o test_persistent
+//  ./test_persistent [path]
+//
+// A child process allocates and frees on the heap and exits without pheap_close, like a crash.
+// The parent reopens the file, checks that the data reachable from the root survived, that the
+// statistics rebuilt from the blocks add up, and that the heap is usable again afterwards.
+
+#include <cstdio>
+#include <sys/wait.h>
+#include <unistd.h>
+
+bool pheap_open(const char *path, size_t capacity);
+void pheap_close();
+void *pmalloc(size_t size);
+void *pcalloc(size_t num, size_t size);
+void pfree(void *p);
+size_t pheap_offset(void *p);
+void *pheap_pointer(size_t offset);
+void pheap_set_root(void *p);
+void *pheap_root();
+size_t _pnum_free_blocks();
+size_t _pnum_free_bytes();
+size_t _pnum_allocated_blocks();
+size_t _pnum_allocated_bytes();
+size_t _pnum_meta_data_bytes();
+size_t _psize_meta_data();
+
+#define CAPACITY (1024 * 1024)
+#define NODES 100
+
+struct Node {
+    size_t next; // offset of the next node, 0 ends the list
+    int value;
+};
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                                     \
+    do {                                                                                                     \
+        if (!(condition)) {                                                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                    \
+            failures++;                                                                                      \
+        }                                                                                                    \
+    } while (0)
+
+// builds a list of NODES nodes with garbage freed in between, then "crashes"
+static void crashingChild(const char *path) {
+    if (!pheap_open(path, CAPACITY))
+        _exit(2);
+    size_t head = 0;
+    for (int i = NODES - 1; i >= 0; i--) {
+        void *garbage = pmalloc(200 + i);
+        Node *node = (Node *)pmalloc(sizeof(Node));
+        node->next = head;
+        node->value = i;
+        head = pheap_offset(node);
+        pheap_set_root(node);
+        if (i % 3 == 0)
+            pfree(garbage);
+    }
+    _exit(0); // no pheap_close: the header stays dirty, top/last/free_head changed since the last seal
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "test_persistent.heap";
+    unlink(path);
+
+    // the statistics are 0, not a crash, while no heap is open
+    CHECK(_pnum_allocated_blocks() == 0 && _pnum_free_blocks() == 0 && _pnum_meta_data_bytes() == 0);
+    CHECK(pcalloc((size_t)-1 / 2, 4) == NULL);
+
+    pid_t child = fork();
+    if (child == 0)
+        crashingChild(path);
+    int status;
+    waitpid(child, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    CHECK(pheap_open(path, CAPACITY));
+    int count = 0;
+    for (Node *node = (Node *)pheap_root(); node != NULL; node = (Node *)pheap_pointer(node->next)) {
+        CHECK(node->value == count);
+        count++;
+    }
+    CHECK(count == NODES);
+
+    // every block is counted once, free blocks were merged or kept, none were lost
+    size_t blocks = _pnum_allocated_blocks();
+    CHECK(blocks >= NODES + NODES - (NODES + 2) / 3);
+    CHECK(_pnum_free_blocks() > 0 && _pnum_free_blocks() <= (NODES + 2) / 3);
+    CHECK(_pnum_meta_data_bytes() == blocks * _psize_meta_data());
+
+    // the rebuilt free list is used again
+    size_t free_bytes = _pnum_free_bytes();
+    void *reused = pmalloc(200);
+    CHECK(reused != NULL && _pnum_free_bytes() < free_bytes);
+    CHECK(pheap_offset(reused) != 0);
+    CHECK(pheap_offset((char *)pheap_root() + CAPACITY) == 0);
+    pfree(reused);
+    blocks = _pnum_allocated_blocks();
+    pheap_close();
+
+    // and the heap closed cleanly after the recovery reopens as it was
+    CHECK(pheap_open(path, CAPACITY));
+    CHECK(_pnum_allocated_blocks() == blocks);
+    CHECK(((Node *)pheap_root())->value == 0);
+    pheap_close();
+    CHECK(_pnum_allocated_blocks() == 0);
+
+    unlink(path);
+    printf("%s\n", failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,228 @@
+//
+// cache.c: Shared in-memory cache of static files. See cache.h.
+//
+
+#include "cache.h"
+#include "segel.h"
+
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t *lru_head; // most recently used
+    cache_entry_t *lru_tail; // next to be evicted
+    size_t bytes;
+    // statistics
+    long hits;
+    long misses;
+    long evictions;
+    long entries;
+} cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+static size_t shard_capacity = 0; // 0 while the cache is off
+
+// FNV-1a
+static unsigned hashPath(const char *path) {
+    unsigned hash = 2166136261u;
+    for (; *path; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t entryBytes(cache_entry_t *entry) {
+    return entry->size + entry->headers_len + strlen(entry->path) + sizeof(cache_entry_t);
+}
+
+static bool sameFile(cache_entry_t *entry, struct stat *sbuf) {
+    return entry->dev == sbuf->st_dev && entry->ino == sbuf->st_ino && entry->size == sbuf->st_size &&
+           entry->mtime.tv_sec == sbuf->st_mtim.tv_sec && entry->mtime.tv_nsec == sbuf->st_mtim.tv_nsec &&
+           S_ISREG(sbuf->st_mode) && (S_IRUSR & sbuf->st_mode);
+}
+
+static void freeEntry(cache_entry_t *entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry->headers);
+    free(entry);
+}
+
+static void lruUnlink(cache_shard_t *shard, cache_entry_t *entry) {
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        shard->lru_head = entry->lru_next;
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        shard->lru_tail = entry->lru_prev;
+}
+
+static void lruPushFront(cache_shard_t *shard, cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL)
+        shard->lru_head->lru_prev = entry;
+    else
+        shard->lru_tail = entry;
+    shard->lru_head = entry;
+}
+
+// take the entry out of the shard (caller holds the lock). it is freed once nobody is writing it
+static void removeEntry(cache_shard_t *shard, cache_entry_t *entry) {
+    cache_entry_t **link = &shard->buckets[(entry->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    lruUnlink(shard, entry);
+    shard->bytes -= entryBytes(entry);
+    shard->entries -= 1;
+    entry->evicted = true;
+    if (entry->refs == 0)
+        freeEntry(entry);
+}
+
+void cacheInit(size_t capacity) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(cache_shard_t));
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    shard_capacity = capacity / CACHE_SHARDS;
+}
+
+bool cacheEnabled() {
+    return shard_capacity > 0;
+}
+
+cache_entry_t *cacheLookup(const char *path) {
+    unsigned hash = hashPath(path);
+    cache_shard_t *shard = &shards[hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *entry = shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0))
+        entry = entry->hash_next;
+
+    if (entry != NULL) {
+        time_t now = time(NULL);
+        if (now - entry->checked >= CACHE_REVALIDATE_SECONDS) {
+            struct stat sbuf;
+            if (stat(path, &sbuf) == 0 && sameFile(entry, &sbuf)) {
+                entry->checked = now;
+            } else { // changed or gone, the caller looks at the file itself
+                removeEntry(shard, entry);
+                entry = NULL;
+            }
+        }
+    }
+    if (entry == NULL) {
+        shard->misses += 1;
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    shard->hits += 1;
+    entry->refs += 1;
+    lruUnlink(shard, entry);
+    lruPushFront(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+// read the whole file, the bytes it has now are the ones that get cached
+static char *readFile(const char *path, off_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    char *data = malloc(size > 0 ? size : 1);
+    if (data == NULL) {
+        close(fd);
+        return NULL;
+    }
+    ssize_t n = rio_readn(fd, data, size);
+    close(fd);
+    if (n != size) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+cache_entry_t *cacheInsert(const char *path, struct stat *sbuf, const char *filetype) {
+    char headers[MAXLINE];
+    int headers_len = sprintf(headers, "Server: OS-HW3 Web Server\r\nContent-Length: %ld\r\nContent-Type: %s\r\n",
+                              (long)sbuf->st_size, filetype);
+    size_t bytes = sbuf->st_size + headers_len + strlen(path) + sizeof(cache_entry_t);
+    if (!cacheEnabled() || bytes > shard_capacity / 4) // a few big files would flush everything else
+        return NULL;
+
+    // build the entry before taking the lock, reading the file is the slow part.
+    // without the memory for it the file is simply served uncached
+    cache_entry_t *entry = malloc(sizeof(cache_entry_t));
+    if (entry == NULL)
+        return NULL;
+    entry->data = readFile(path, sbuf->st_size);
+    entry->path = strdup(path);
+    entry->headers = strdup(headers);
+    if (entry->data == NULL || entry->path == NULL || entry->headers == NULL) {
+        free(entry->data);
+        free(entry->path);
+        free(entry->headers);
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hashPath(path);
+    entry->dev = sbuf->st_dev;
+    entry->ino = sbuf->st_ino;
+    entry->mtime = sbuf->st_mtim;
+    entry->size = sbuf->st_size;
+    entry->checked = time(NULL);
+    entry->headers_len = headers_len;
+    entry->refs = 1;
+    entry->evicted = false;
+
+    cache_shard_t *shard = &shards[entry->hash % CACHE_SHARDS];
+    cache_entry_t **bucket = &shard->buckets[(entry->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+    pthread_mutex_lock(&shard->lock);
+    // another worker may have cached the same file meanwhile, the newer read wins
+    for (cache_entry_t *old = *bucket; old != NULL; old = old->hash_next) {
+        if (old->hash == entry->hash && strcmp(old->path, path) == 0) {
+            removeEntry(shard, old);
+            break;
+        }
+    }
+    while (shard->bytes + bytes > shard_capacity && shard->lru_tail != NULL) {
+        removeEntry(shard, shard->lru_tail);
+        shard->evictions += 1;
+    }
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lruPushFront(shard, entry);
+    shard->bytes += bytes;
+    shard->entries += 1;
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void cacheRelease(cache_entry_t *entry) {
+    cache_shard_t *shard = &shards[entry->hash % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    entry->refs -= 1;
+    bool unused = entry->evicted && entry->refs == 0;
+    pthread_mutex_unlock(&shard->lock);
+    if (unused)
+        freeEntry(entry);
+}
+
+void cacheGetStats(cache_stats_t *stats) {
+    memset(stats, 0, sizeof(cache_stats_t));
+    stats->capacity = shard_capacity * CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats->hits += shards[i].hits;
+        stats->misses += shards[i].misses;
+        stats->evictions += shards[i].evictions;
+        stats->entries += shards[i].entries;
+        stats->bytes += shards[i].bytes;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
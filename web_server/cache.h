@@ -0,0 +1,66 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "stdbool.h"
+#include <sys/stat.h>
+#include <time.h>
+
+//
+// cache.h: Shared in-memory cache of static files (the cache server option).
+//
+// Files are kept whole, together with the part of their response header that never changes, and
+// evicted least recently used first when the cache is over its capacity. The cache is split into
+// shards with a lock each, so workers serving different files rarely wait for each other.
+// An entry is trusted for CACHE_REVALIDATE_SECONDS, after that it is checked against stat() again.
+//
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256                // hash buckets per shard
+#define CACHE_REVALIDATE_SECONDS 1       // how stale a cached file may be
+#define CACHE_DEFAULT_CAPACITY (64 << 20) // bytes, when the option gives no size
+
+typedef struct cache_entry {
+    char *path;
+    unsigned hash;
+    // identity of the file the bytes were read from
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    time_t checked; // last time the file was found unchanged
+    // response
+    char *data;
+    char *headers; // "Server: ...Content-Length: ...Content-Type: ...\r\n" lines
+    int headers_len;
+    // owned by the shard
+    int refs;     // workers still writing the entry out
+    bool evicted; // no longer in the cache, freed by the last release
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev; // more recently used
+    struct cache_entry *lru_next; // less recently used
+} cache_entry_t;
+
+typedef struct cache_stats {
+    long hits;
+    long misses;
+    long evictions;
+    long entries;
+    size_t bytes;
+    size_t capacity;
+} cache_stats_t;
+
+void cacheInit(size_t capacity);
+bool cacheEnabled();
+
+// returns the cached file pinned until cacheRelease, or NULL if it is not (validly) cached
+cache_entry_t *cacheLookup(const char *path);
+
+// reads the file described by sbuf into the cache and returns it pinned.
+// NULL if it does not fit in a shard or could not be read, then it should be served from disk
+cache_entry_t *cacheInsert(const char *path, struct stat *sbuf, const char *filetype);
+
+void cacheRelease(cache_entry_t *entry);
+
+void cacheGetStats(cache_stats_t *stats);
+
+#endif
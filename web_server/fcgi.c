@@ -0,0 +1,267 @@
+//
+// fcgi.c: Pools of persistent CGI processes. See fcgi.h.
+//
+
+#define _GNU_SOURCE // posix_spawn_file_actions_addclosefrom_np
+#include "fcgi.h"
+#include "segel.h"
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define REAPER_MAX_EVENTS 64
+
+typedef struct fcgi_process {
+    pid_t pid;
+    int fd; // server end of the socket
+    struct fcgi_process *next_idle;
+} fcgi_process_t;
+
+typedef struct fcgi_program {
+    char path[MAXLINE];
+    pthread_mutex_t lock;
+    pthread_cond_t idle_available;
+    fcgi_process_t *idle; // processes not serving a request
+} fcgi_program_t;
+
+static fcgi_program_t programs[FCGI_MAX_PROGRAMS];
+static int programs_count = 0;
+static int reaper_epfd = -1; // -1 while there is no reaper
+
+// a peer that went away is an error here, not a SIGPIPE
+static int sendAll(int fd, const char *buf, int len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+int fcgiWriteRecord(int fd, int type, const void *content, int len) {
+    // header and content leave in one sendmsg, the content is not copied
+    fcgi_header_t header = {FCGI_VERSION_1, type, 0, 1, (len >> 8) & 0xff, len & 0xff, 0, 0};
+    struct iovec iov[2] = {{&header, sizeof(header)}, {(void *)content, len}};
+    struct msghdr message = {0};
+    message.msg_iov = iov;
+    message.msg_iovlen = len > 0 ? 2 : 1;
+    while (message.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+        // skip what the socket took, the rest goes out with the next call
+        while (message.msg_iovlen > 0 && (size_t)sent >= message.msg_iov->iov_len) {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (char *)message.msg_iov->iov_base + sent;
+            message.msg_iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+int fcgiReadRecord(int fd, char *content, int *len) {
+    fcgi_header_t header;
+    char padding[256];
+    if (rio_readn(fd, &header, sizeof(header)) != sizeof(header))
+        return -1;
+    *len = (header.content_length_b1 << 8) | header.content_length_b0;
+    if (rio_readn(fd, content, *len) != *len ||
+        rio_readn(fd, padding, header.padding_length) != header.padding_length)
+        return -1;
+    content[*len] = '\0';
+    return header.type;
+}
+
+pid_t cgiSpawn(const char *path, char *argv[], char *envp[], int fd, int target_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t no_signals, default_signals;
+    sigemptyset(&no_signals);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE); // ignored by the server, an ignored signal survives exec
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd, target_fd); // the copy is not close on exec
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+    // the server's descriptors are close on exec, this also covers any opened without the flag
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &no_signals); // the server threads block SIGUSR1 (cache option)
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    pid_t pid;
+    int rc = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        fprintf(stderr, "posix_spawn %s: %s\n", path, strerror(rc));
+        return -1;
+    }
+    return pid;
+}
+
+static int pidfdOpen(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0); // close on exec
+}
+
+static void *cgiReaper(void *unused) {
+    struct epoll_event events[REAPER_MAX_EVENTS];
+    while (1) {
+        int ready = epoll_wait(reaper_epfd, events, REAPER_MAX_EVENTS, -1);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready == -1)
+            unix_error("Epoll_wait error");
+        for (int i = 0; i < ready; i++) {
+            // a pidfd is readable once its process exited
+            WaitPid(events[i].data.u64 >> 32, NULL, 0);
+            Close(events[i].data.u64 & 0xffffffff); // leaves the epoll set with it
+        }
+    }
+    return NULL;
+}
+
+bool cgiReaperStart() {
+    int probe = pidfdOpen(getpid());
+    if (probe == -1) {
+        fprintf(stderr, "asynccgi: no pidfd support (%s), workers wait for CGI programs\n", strerror(errno));
+        return false;
+    }
+    Close(probe);
+    if ((reaper_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("Epoll_create1 error");
+    pthread_t reaper;
+    int rc;
+    if ((rc = pthread_create(&reaper, NULL, cgiReaper, NULL)) != 0)
+        posix_error(rc, "Pthread_create error");
+    pthread_detach(reaper);
+    return true;
+}
+
+bool cgiReapLater(pid_t pid) {
+    if (reaper_epfd == -1)
+        return false;
+    int pidfd = pidfdOpen(pid);
+    if (pidfd == -1)
+        return false;
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = ((uint64_t)pid << 32) | (uint32_t)pidfd};
+    if (epoll_ctl(reaper_epfd, EPOLL_CTL_ADD, pidfd, &event) < 0) {
+        Close(pidfd);
+        return false;
+    }
+    return true;
+}
+
+// on failure pid and fd are -1, the next request finds the process broken and tries again
+static void spawnProcess(fcgi_program_t *program, fcgi_process_t *process) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        unix_error("Socketpair error");
+    char *argv[] = {program->path, FCGI_PERSISTENT_ARG, NULL};
+    process->pid = cgiSpawn(program->path, argv, environ, fds[1], STDIN_FILENO);
+    process->fd = fds[0];
+    Close(fds[1]);
+    if (process->pid == -1) {
+        Close(process->fd);
+        process->fd = -1;
+    }
+}
+
+// replace a process that broke the protocol or exited
+static void respawnProcess(fcgi_program_t *program, fcgi_process_t *process) {
+    if (process->pid != -1) {
+        Close(process->fd);
+        kill(process->pid, SIGKILL);
+        WaitPid(process->pid, NULL, 0);
+    }
+    spawnProcess(program, process);
+}
+
+// "./public//a.cgi" and "./public/a.cgi" are the same program
+static bool samePath(const char *a, const char *b) {
+    while (*a != '\0' && *a == *b) {
+        if (*a == '/') {
+            while (a[1] == '/')
+                a++;
+            while (b[1] == '/')
+                b++;
+        }
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+void fcgiRegister(const char *path, int processes) {
+    if (programs_count == FCGI_MAX_PROGRAMS) {
+        fprintf(stderr, "fcgi: too many programs, %s starts a process per request\n", path);
+        return;
+    }
+    fcgi_program_t *program = &programs[programs_count];
+    snprintf(program->path, MAXLINE, "%s", path);
+    pthread_mutex_init(&program->lock, NULL);
+    pthread_cond_init(&program->idle_available, NULL);
+    program->idle = NULL;
+    for (int i = 0; i < processes; i++) {
+        fcgi_process_t *process = malloc(sizeof(fcgi_process_t));
+        spawnProcess(program, process);
+        process->next_idle = program->idle;
+        program->idle = process;
+    }
+    programs_count += 1;
+}
+
+bool fcgiServe(const char *path, const char *query, int fd, char *content) {
+    fcgi_program_t *program = NULL;
+    for (int i = 0; i < programs_count && program == NULL; i++) {
+        if (samePath(programs[i].path, path))
+            program = &programs[i];
+    }
+    if (program == NULL)
+        return false;
+
+    // a process serves one request at a time, the rest wait for one to be idle
+    pthread_mutex_lock(&program->lock);
+    while (program->idle == NULL)
+        pthread_cond_wait(&program->idle_available, &program->lock);
+    fcgi_process_t *process = program->idle;
+    program->idle = process->next_idle;
+    pthread_mutex_unlock(&program->lock);
+
+    // relay the output until the end of the request. the records are read to the end even when the
+    // client is gone, so the next request starts at a record boundary
+    long written = 0;
+    bool client_gone = false;
+    bool broken = fcgiWriteRecord(process->fd, FCGI_PARAMS, query, strlen(query)) < 0;
+    int type, len;
+    while (!broken && (type = fcgiReadRecord(process->fd, content, &len)) != FCGI_END_REQUEST) {
+        if (type == -1) {
+            broken = true;
+        } else if (type == FCGI_STDOUT && !client_gone) {
+            client_gone = sendAll(fd, content, len) < 0;
+            written += len;
+        }
+    }
+    if (broken)
+        respawnProcess(program, process);
+
+    pthread_mutex_lock(&program->lock);
+    process->next_idle = program->idle;
+    program->idle = process;
+    pthread_cond_signal(&program->idle_available);
+    pthread_mutex_unlock(&program->lock);
+    // a process that died before printing anything leaves the request to the process per request path
+    return !(broken && written == 0);
+}
@@ -0,0 +1,76 @@
+#ifndef __FCGI_H__
+#define __FCGI_H__
+
+#include "stdbool.h"
+#include <sys/types.h>
+
+//
+// fcgi.h: Pools of persistent CGI processes (the fcgi server option).
+//
+// A registered program is started ahead of time as a few long lived processes, each connected to the
+// server by a Unix socket on its standard input. A dynamic request borrows an idle process, sends it
+// the query string and relays the output back to the client, so it costs a round trip instead of
+// starting a process. Programs that were not registered keep the process per request path.
+//
+// With the asynccgi option such a process is not waited for by the worker. It owns the connection
+// (its stdout) until it exits, and a reaper thread collects it through a pidfd in its epoll set.
+//
+// Messages are framed like FastCGI records: an 8 byte header (version, type, request id, content
+// length, padding length) followed by the content. A request is one FCGI_PARAMS record holding the
+// query string, answered by FCGI_STDOUT records and a closing FCGI_END_REQUEST.
+//
+
+#define FCGI_MAX_PROGRAMS 8
+#define FCGI_MAX_CONTENT 65535          // content bytes in one record
+#define FCGI_PERSISTENT_ARG "--persistent" // argv[1] of a pooled process
+
+#define FCGI_VERSION_1 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDOUT 6
+
+typedef struct fcgi_header {
+    unsigned char version;
+    unsigned char type;
+    unsigned char request_id_b1;
+    unsigned char request_id_b0;
+    unsigned char content_length_b1;
+    unsigned char content_length_b0;
+    unsigned char padding_length;
+    unsigned char reserved;
+} fcgi_header_t;
+
+// both sides of the socket
+
+// write one record. -1 on error
+int fcgiWriteRecord(int fd, int type, const void *content, int len);
+
+// read one record into content (at least FCGI_MAX_CONTENT + 1 bytes, it is null terminated).
+// returns its type and sets *len, -1 on error or end of file
+int fcgiReadRecord(int fd, char *content, int *len);
+
+// server side
+
+// start a CGI program with fd as its target_fd and no signal blocked. every other descriptor of the
+// server is close on exec (and closed in the child, where posix_spawn can). posix_spawn does not copy the page tables of the server the way fork does,
+// so the cost does not grow with the server. returns the pid, -1 if it could not be started
+pid_t cgiSpawn(const char *path, char *argv[], char *envp[], int fd, int target_fd);
+
+// start the reaper thread (asynccgi option). false if this kernel has no pidfds, children are
+// waited for by the workers then
+bool cgiReaperStart();
+
+// hand an exited or running child to the reaper. false if there is none (or it can not watch the child),
+// then the caller waits for it
+bool cgiReapLater(pid_t pid);
+
+// start processes copies of the program at path
+void fcgiRegister(const char *path, int processes);
+
+// if the program at path is registered, run the request on one of its processes and write what it
+// prints to fd, reading the records into content (FCGI_MAX_CONTENT + 1 bytes, the caller's so that it
+// is not on the worker's stack). false if it is not (or its process could not take the request),
+// nothing was written then
+bool fcgiServe(const char *path, const char *query, int fd, char *content);
+
+#endif
@@ -0,0 +1,136 @@
+//
+// http.c: Parsing request headers in place. See http.h.
+//
+
+#include "http.h"
+#include "segel.h"
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+// bit i is set if buf[block + i] is a '\n', for the up to 16 bytes of the block before len
+static unsigned newlineMask(const char *buf, int block, int len) {
+#ifdef __SSE2__
+    if (block + 16 <= len) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(buf + block));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+    }
+#endif
+    unsigned mask = 0;
+    for (int i = 0; i < 16 && block + i < len; i++) {
+        if (buf[block + i] == '\n')
+            mask |= 1u << i;
+    }
+    return mask;
+}
+
+void httpInit(http_request_t *request) {
+    memset(request, 0, sizeof(http_request_t));
+}
+
+static http_view_t trim(const char *data, int len) {
+    while (len > 0 && (*data == ' ' || *data == '\t')) {
+        data++;
+        len--;
+    }
+    while (len > 0 && (data[len - 1] == ' ' || data[len - 1] == '\t'))
+        len--;
+    http_view_t view = {data, len};
+    return view;
+}
+
+// the next word of line[*pos..len), words are separated by spaces or tabs
+static http_view_t nextWord(const char *line, int len, int *pos) {
+    while (*pos < len && (line[*pos] == ' ' || line[*pos] == '\t'))
+        *pos += 1;
+    int start = *pos;
+    while (*pos < len && line[*pos] != ' ' && line[*pos] != '\t')
+        *pos += 1;
+    http_view_t view = {line + start, *pos - start};
+    return view;
+}
+
+// one line without its line break. true if it was the empty line ending the header
+static bool parseLine(http_request_t *request, const char *line, int len) {
+    if (!request->has_request_line) {
+        if (len == 0)
+            return false;
+        int pos = 0;
+        request->method = nextWord(line, len, &pos);
+        request->uri = nextWord(line, len, &pos);
+        request->version = nextWord(line, len, &pos);
+        request->has_request_line = true;
+        return false;
+    }
+    if (len == 0)
+        return true;
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL || request->headers_count == HTTP_MAX_HEADERS) // not a header (or one too many)
+        return false;
+    http_header_t *header = &request->headers[request->headers_count++];
+    header->name = trim(line, colon - line);
+    header->value = trim(colon + 1, line + len - colon - 1);
+    return false;
+}
+
+static void rebase(http_view_t *view, const char *from, const char *to) {
+    if (view->data != NULL)
+        view->data = to + (view->data - from);
+}
+
+int httpParse(http_request_t *request, const char *buf, int len) {
+    if (request->base != NULL && request->base != buf) { // the bytes moved, and the views with them
+        rebase(&request->method, request->base, buf);
+        rebase(&request->uri, request->base, buf);
+        rebase(&request->version, request->base, buf);
+        for (int i = 0; i < request->headers_count; i++) {
+            rebase(&request->headers[i].name, request->base, buf);
+            rebase(&request->headers[i].value, request->base, buf);
+        }
+    }
+    request->base = buf;
+
+    int line = request->parsed; // start of the next line
+    for (int block = line; block < len; block += 16) {
+        unsigned mask = newlineMask(buf, block, len);
+        while (mask != 0) { // every line ending in this block
+            int end = block + __builtin_ctz(mask);
+            mask &= mask - 1;
+            int line_len = end - line;
+            if (line_len > 0 && buf[end - 1] == '\r')
+                line_len--;
+            bool done = parseLine(request, buf + line, line_len);
+            line = end + 1;
+            request->parsed = line;
+            if (done)
+                return line;
+        }
+    }
+    return 0;
+}
+
+int httpHeaderEnd(const char *buf, int from, int len) {
+    for (int block = from; block < len; block += 16) {
+        unsigned mask = newlineMask(buf, block, len);
+        while (mask != 0) {
+            int end = block + __builtin_ctz(mask);
+            mask &= mask - 1;
+            // a line break right after another one ends the header
+            if ((end >= 1 && buf[end - 1] == '\n') || (end >= 2 && buf[end - 1] == '\r' && buf[end - 2] == '\n'))
+                return end + 1;
+        }
+    }
+    return 0;
+}
+
+http_view_t *httpHeader(http_request_t *request, const char *name) {
+    for (int i = 0; i < request->headers_count; i++) {
+        if (httpViewIs(request->headers[i].name, name))
+            return &request->headers[i].value;
+    }
+    return NULL;
+}
+
+bool httpViewIs(http_view_t view, const char *string) {
+    return (int)strlen(string) == view.len && (view.len == 0 || strncasecmp(view.data, string, view.len) == 0);
+}
@@ -0,0 +1,58 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "stdbool.h"
+
+//
+// http.h: Parsing request headers in place.
+//
+// The parser works on the bytes of the read buffer: method, URI, version and headers are views into
+// it, nothing is copied or allocated. It is incremental: a header that arrived in pieces is parsed as
+// far as its complete lines go, and the next call goes on from there. Lines end with "\r\n" or a bare
+// "\n", and the end of the next line is found 16 bytes at a time (SSE2) rather than byte by byte.
+//
+
+#define HTTP_MAX_HEADERS 32 // further header lines are skipped
+
+// a string in the read buffer, not null terminated
+typedef struct http_view {
+    const char *data;
+    int len;
+} http_view_t;
+
+typedef struct http_header {
+    http_view_t name;
+    http_view_t value; // without the whitespace around it
+} http_header_t;
+
+typedef struct http_request {
+    http_view_t method;
+    http_view_t uri;
+    http_view_t version; // empty for a request line without one
+    http_header_t headers[HTTP_MAX_HEADERS];
+    int headers_count;
+    // parser state
+    const char *base; // buffer of the last httpParse call
+    int parsed;       // bytes of the complete lines parsed so far
+    bool has_request_line;
+} http_request_t;
+
+// start parsing a new request
+void httpInit(http_request_t *request);
+
+// parse the header at buf[0..len), going on where the last call on request stopped. buf may have moved
+// since (the bytes before len are the same). returns the length of the header with its empty line
+// once it is complete, 0 while more bytes are needed. empty lines before the request line are skipped
+int httpParse(http_request_t *request, const char *buf, int len);
+
+// length of the header with its empty line if buf[0..len) holds a whole one, 0 otherwise. bytes before
+// from were checked already (a cheaper check for a buffer that grows, no views)
+int httpHeaderEnd(const char *buf, int from, int len);
+
+// the value of the named header, NULL if the request has none
+http_view_t *httpHeader(http_request_t *request, const char *name);
+
+// case insensitive
+bool httpViewIs(http_view_t view, const char *string);
+
+#endif
@@ -47,11 +47,12 @@ void clientSend(int fd, char *filename) {
  */
 void clientPrint(int fd) {
     rio_t rio;
+    char rio_buf[RIO_BUFSIZE];
     char buf[MAXBUF];
     int length = 0;
     int n;
 
-    Rio_readinitb(&rio, fd);
+    Rio_readinitbuf(&rio, fd, rio_buf, sizeof(rio_buf));
 
     /* Read and display the HTTP Header */
     n = Rio_readlineb(&rio, buf, MAXBUF);
@@ -1,4 +1,5 @@
 #include "segel.h"
+#include "fcgi.h"
 #include <sys/time.h>
 #include <assert.h>
 #include <unistd.h>
@@ -8,16 +9,19 @@
 // This program is intended to help you test your web server.
 // You can use it to test that you are correctly having multiple threads
 // handling http requests.
+//
+// Started with --persistent (the fcgi server option) it stays up and
+// answers the requests the server sends over its standard input, see fcgi.h.
 // 
 
 double spinfor = 5.0;
 
-void getargs()
+void getargs(char *buf)
 {
-  char *buf, *p;
+  char *p;
 
   /* Extract the four arguments */
-  if ((buf = getenv("QUERY_STRING")) != NULL) {
+  if (buf != NULL) {
     p = strtok(buf, "&");
     if (p == NULL) 
       return;
@@ -34,12 +38,11 @@ double Time_GetSeconds() {
 }
 
 
-int main(int argc, char *argv[])
+// builds the response (the rest of the header and the body) into response, returns its length
+int makeResponse(char *response)
 {
   char content[MAXBUF];
 
-  getargs();
-
   double t1 = Time_GetSeconds();
   usleep(spinfor * 1e6);
   double t2 = Time_GetSeconds();
@@ -50,11 +53,42 @@ int main(int argc, char *argv[])
   sprintf(content, "%s<p>I spun for %.2f seconds</p>\r\n", content, t2 - t1);
   
   /* Generate the HTTP response */
-  printf("Content-length: %lu\r\n", strlen(content));
-  printf("Content-type: text/html\r\n\r\n");
-  printf("%s", content);
-  fflush(stdout);
+  return sprintf(response, "Content-length: %lu\r\nContent-type: text/html\r\n\r\n%s",
+                 strlen(content), content);
+}
+
+void servePersistent()
+{
+  char query[FCGI_MAX_CONTENT + 1];
+  char response[2 * MAXBUF];
+  int len;
+  int type;
 
+  while ((type = fcgiReadRecord(STDIN_FILENO, query, &len)) != -1) {
+    if (type != FCGI_PARAMS)
+      continue;
+    spinfor = 5.0;
+    getargs(query);
+    len = makeResponse(response);
+    if (fcgiWriteRecord(STDIN_FILENO, FCGI_STDOUT, response, len) < 0 ||
+        fcgiWriteRecord(STDIN_FILENO, FCGI_END_REQUEST, NULL, 0) < 0)
+      break;
+  }
+  /* the server went away */
   exit(0);
 }
 
+int main(int argc, char *argv[])
+{
+  char response[2 * MAXBUF];
+
+  if (argc > 1 && strcmp(argv[1], FCGI_PERSISTENT_ARG) == 0)
+    servePersistent();
+
+  getargs(getenv("QUERY_STRING"));
+  makeResponse(response);
+  printf("%s", response);
+  fflush(stdout);
+
+  exit(0);
+}
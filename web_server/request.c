@@ -2,102 +2,286 @@
 // request.c: Does the bulk of the work for the web server.
 //
 
+#define _GNU_SOURCE // memmem
 #include "request.h"
+#include "cache.h"
+#include "fcgi.h"
+#include "http.h"
 #include "segel.h"
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+// Response header under construction. Pieces are appended at len, so nothing is ever rescanned,
+// and whatever does not fit in the buffer is cut off rather than overflowing it.
+typedef struct header {
+    char buf[MAXBUF];
+    int len;
+} header_t;
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+// append a string literal, its length is known at compile time
+#define HDR_LITERAL(header, literal) hdrAppend(header, literal, sizeof(literal) - 1)
+
+void hdrAppend(header_t *header, const char *data, int len) {
+    if (len > MAXBUF - header->len)
+        len = MAXBUF - header->len;
+    memcpy(header->buf + header->len, data, len);
+    header->len += len;
+}
+
+void hdrString(header_t *header, const char *string) {
+    hdrAppend(header, string, strlen(string));
+}
+
+// decimal digits are produced from the end, no format string to interpret
+void hdrInt(header_t *header, long value) {
+    char digits[24];
+    int start = sizeof(digits);
+    unsigned long magnitude = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    do {
+        digits[--start] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0)
+        digits[--start] = '-';
+    hdrAppend(header, digits + start, sizeof(digits) - start);
+}
+
+// <seconds>.<6 digit microseconds>
+void hdrTime(header_t *header, timeval_t time) {
+    char micros[6];
+    long rest = time.tv_usec;
+    for (int i = 5; i >= 0; i--) {
+        micros[i] = '0' + rest % 10;
+        rest /= 10;
+    }
+    hdrInt(header, time.tv_sec);
+    HDR_LITERAL(header, ".");
+    hdrAppend(header, micros, sizeof(micros));
+}
+
+// A response collected as iovecs: the header built in place plus body pieces that are referenced,
+// not copied. Everything collected leaves in one sendmsg; only if the socket takes part of it does
+// sending continue from where it stopped.
+#define RESPONSE_MAX_BODY 2
+
+typedef struct response {
+    header_t header;
+    bool header_sent;
+    struct iovec body[RESPONSE_MAX_BODY];
+    int body_count;
+} response_t;
+
+// what requestHandle would otherwise put on the stack of the worker, large arrays it only fills in part.
+// a worker keeps one and reuses it for every request
+struct request_scratch {
+    http_request_t request;
+    response_t response;
+    header_t error_body;
+    char filename[MAXLINE];
+    char cgiargs[MAXLINE];
+    char filetype[MAXLINE];
+    char method[MAXLINE];                        // of a request that is refused
+    char query[MAXLINE + sizeof("QUERY_STRING=")]; // CGI environment
+    char fcgi_content[FCGI_MAX_CONTENT + 1];        // a record from a pooled CGI process
+};
+
+request_scratch_t *requestScratchCreate() {
+    return malloc(sizeof(request_scratch_t));
+}
+
+// appending statistics. does not add extra \r\n
+void buf_stats(header_t *header, statistics_t stats, int is_static) {
+    HDR_LITERAL(header, "Stat-Req-Arrival:: ");
+    hdrTime(header, stats.arrival_time);
+    HDR_LITERAL(header, "\r\nStat-Req-Dispatch:: ");
+    hdrTime(header, stats.dispatch_interval);
+    HDR_LITERAL(header, "\r\nStat-Thread-Id:: ");
+    hdrInt(header, stats.thread_id);
+    HDR_LITERAL(header, "\r\nStat-Thread-Count:: ");
+    hdrInt(header, stats.requests_count + 1); // add the current request to stats counters
+    HDR_LITERAL(header, "\r\nStat-Thread-Static:: ");
+    hdrInt(header, stats.static_requests_count + (int)(is_static == 1));
+    HDR_LITERAL(header, "\r\nStat-Thread-Dynamic:: ");
+    hdrInt(header, stats.dynamic_requests_count + (int)(is_static == 0));
+    HDR_LITERAL(header, "\r\n");
+}
+
+// starting a header: the status line and, for a keepalive server, the connection headers
+void buf_status(header_t *header, connection_t *conn, char *status) {
+    header->len = 0;
+    if (!conn->keepalive) {
+        HDR_LITERAL(header, "HTTP/1.0 ");
+        hdrString(header, status);
+        HDR_LITERAL(header, "\r\n");
+        return;
+    }
+    HDR_LITERAL(header, "HTTP/1.1 ");
+    hdrString(header, status);
+    if (conn->keep_open) {
+        HDR_LITERAL(header, "\r\nConnection: keep-alive\r\nKeep-Alive: timeout=" TO_STRING(KEEPALIVE_TIMEOUT) ", max=");
+        hdrInt(header, KEEPALIVE_MAX_REQUESTS - conn->requests - 1);
+        HDR_LITERAL(header, "\r\n");
+    } else {
+        HDR_LITERAL(header, "\r\nConnection: close\r\n");
+    }
+}
 
-// buffering statistics. overriding buffer content. does not add extra \r\n
-void buf_stats(char *buf, statistics_t stats, int is_static) {
-    sprintf(buf, "Stat-Req-Arrival:: %ld.%06ld\r\n", stats.arrival_time.tv_sec, stats.arrival_time.tv_usec);
-    sprintf(buf, "%sStat-Req-Dispatch:: %ld.%06ld\r\n", //
-            buf, stats.dispatch_interval.tv_sec, stats.dispatch_interval.tv_usec);
-    sprintf(buf, "%sStat-Thread-Id:: %d\r\n", buf, stats.thread_id);
-    sprintf(buf, "%sStat-Thread-Count:: %d\r\n", buf,
-            stats.requests_count + 1); // add the current request to stats counters
-    sprintf(buf, "%sStat-Thread-Static:: %d\r\n", buf, stats.static_requests_count + (int)(is_static == 1));
-    sprintf(buf, "%sStat-Thread-Dynamic:: %d\r\n", buf, stats.dynamic_requests_count + (int)(is_static == 0));
-    // printf("%s", buf);
+void responseStart(response_t *response, connection_t *conn, char *status) {
+    buf_status(&response->header, conn, status);
+    response->header_sent = false;
+    response->body_count = 0;
 }
 
-// requestError(      fd,    filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
-void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, statistics_t stats) {
-    char buf[MAXLINE], body[MAXBUF];
+void responseBody(response_t *response, void *data, size_t len) {
+    response->body[response->body_count].iov_base = data;
+    response->body[response->body_count].iov_len = len;
+    response->body_count += 1;
+}
+
+// Sends what was collected since the last send. more: the rest of the response follows right away
+// (e.g. by sendfile), so the kernel may hold a partial segment back for it.
+// A failed send means the client is gone: the connection is not kept open and -1 is returned.
+int responseSend(connection_t *conn, response_t *response, bool more) {
+    struct iovec iov[RESPONSE_MAX_BODY + 1];
+    int count = 0;
+    if (!response->header_sent) {
+        iov[count].iov_base = response->header.buf;
+        iov[count++].iov_len = response->header.len;
+        response->header_sent = true;
+    }
+    for (int i = 0; i < response->body_count; i++)
+        iov[count++] = response->body[i];
+    response->body_count = 0;
+
+    struct iovec *next = iov;
+    bool is_socket = true;
+    while (count > 0) {
+        // MSG_NOSIGNAL: a client that went away is an error here, not a SIGPIPE for the server
+        struct msghdr message = {.msg_iov = next, .msg_iovlen = count};
+        ssize_t sent = is_socket ? sendmsg(conn->rio->rio_fd, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0))
+                                 : writev(conn->rio->rio_fd, next, count);
+        if (sent == -1 && errno == ENOTSOCK && is_socket) {
+            is_socket = false;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1) {
+            conn->keep_open = false;
+            return -1;
+        }
+        while (count > 0 && (size_t)sent >= next->iov_len) {
+            sent -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (char *)next->iov_base + sent;
+            next->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+// requestError(      conn,    filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
+void requestError(connection_t *conn, char *cause, char *errnum, char *shortmsg, char *longmsg, statistics_t stats) {
+    header_t *body = &conn->scratch->error_body;
+    response_t *response = &conn->scratch->response;
+    char status[64];
 
     // Create the body of the error message
-    sprintf(body, "<html><title>OS-HW3 Error</title>");
-    sprintf(body,
-            "%s<body bgcolor="
-            "fffff"
-            ">\r\n",
-            body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr>OS-HW3 Web Server\r\n", body);
-
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    // printf("%s", buf);
-
-    sprintf(buf, "Content-Type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    // printf("%s", buf);
-
-    sprintf(buf, "Content-Length: %lu\r\n", strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    // printf("%s", buf);
-
-    buf_stats(buf, stats, -1);
-    sprintf(buf, "%s\r\n", buf);
-    Rio_writen(fd, buf, strlen(buf));
-
-    // Write out the content
-    Rio_writen(fd, body, strlen(body));
-    // printf("%s", body);
+    body->len = 0;
+    HDR_LITERAL(body, "<html><title>OS-HW3 Error</title><body bgcolor=fffff>\r\n");
+    hdrString(body, errnum);
+    HDR_LITERAL(body, ": ");
+    hdrString(body, shortmsg);
+    HDR_LITERAL(body, "\r\n<p>");
+    hdrString(body, longmsg);
+    HDR_LITERAL(body, ": ");
+    hdrString(body, cause);
+    HDR_LITERAL(body, "\r\n<hr>OS-HW3 Web Server\r\n");
+
+    // Put together the header information for this response
+    snprintf(status, sizeof(status), "%s %s", errnum, shortmsg);
+    responseStart(response, conn, status);
+    HDR_LITERAL(&response->header, "Content-Type: text/html\r\nContent-Length: ");
+    hdrInt(&response->header, body->len);
+    HDR_LITERAL(&response->header, "\r\n");
+    buf_stats(&response->header, stats, -1);
+    HDR_LITERAL(&response->header, "\r\n");
+
+    // header and content leave in one system call
+    responseBody(response, body->buf, body->len);
+    responseSend(conn, response, false);
 }
 
 //
-// Reads and discards everything up to an empty text line
+// Discards the rest of a header too large for the buffer of rio, so it can be refused without leaving
+// unread bytes behind. The last bytes are kept each round, the empty line may start among them.
+// Returns -1 if the connection ended first.
 //
-void requestReadhdrs(rio_t *rp) {
-    char buf[MAXLINE];
+int requestSkipHeader(rio_t *rio) {
+    int header_len;
+    while ((header_len = httpHeaderEnd(rio->rio_bufptr, 0, rio->rio_cnt)) == 0) {
+        int keep = rio->rio_cnt < 2 ? rio->rio_cnt : 2;
+        rio->rio_bufptr += rio->rio_cnt - keep;
+        rio->rio_cnt = keep;
+        if (rio_fillb(rio) <= 0)
+            return -1;
+    }
+    rio->rio_bufptr += header_len;
+    rio->rio_cnt -= header_len;
+    return 0;
+}
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while (strcmp(buf, "\r\n")) {
-        Rio_readlineb(rp, buf, MAXLINE);
+//
+// Reads until the buffer of rio holds the whole header of the next request and parses it there.
+// The header is consumed, the views of request stay valid until rio reads again.
+// Returns 0 if the connection ended first, -1 if the header does not fit in the buffer (it was skipped).
+//
+int requestReadHeader(rio_t *rio, http_request_t *request) {
+    httpInit(request);
+    int header_len;
+    while ((header_len = httpParse(request, rio->rio_bufptr, rio->rio_cnt)) == 0) {
+        if (rio->rio_cnt == rio->rio_bufsize)
+            return requestSkipHeader(rio) < 0 ? 0 : -1;
+        if (rio_fillb(rio) <= 0) // moves the unread bytes to the start of the buffer, the parser follows
+            return 0;
     }
-    return;
+    rio->rio_bufptr += header_len;
+    rio->rio_cnt -= header_len;
+    return header_len;
 }
 
 //
 // Return 1 if static, 0 if dynamic content
 // Calculates filename (and cgiargs, for dynamic) from uri
 //
-int requestParseURI(char *uri, char *filename, char *cgiargs) {
-    char *ptr;
-
-    if (strstr(uri, "..")) {
+int requestParseURI(http_view_t uri, char *filename, char *cgiargs) {
+    if (memmem(uri.data, uri.len, "..", 2)) {
         sprintf(filename, "./public/home.html");
         return 1;
     }
 
-    if (!strstr(uri, "cgi")) {
+    if (!memmem(uri.data, uri.len, "cgi", 3)) {
         // static
         strcpy(cgiargs, "");
-        sprintf(filename, "./public/%s", uri);
-        if (uri[strlen(uri) - 1] == '/') {
-            strcat(filename, "home.html");
-        }
+        bool directory = uri.len > 0 && uri.data[uri.len - 1] == '/';
+        snprintf(filename, MAXLINE, "./public/%.*s%s", uri.len, uri.data, directory ? "home.html" : "");
         return 1;
     } else {
         // dynamic
-        ptr = index(uri, '?');
-        if (ptr) {
-            strcpy(cgiargs, ptr + 1);
-            *ptr = '\0';
+        const char *query = memchr(uri.data, '?', uri.len);
+        int path_len = uri.len;
+        if (query) {
+            path_len = query - uri.data;
+            snprintf(cgiargs, MAXLINE, "%.*s", uri.len - path_len - 1, query + 1);
         } else {
             strcpy(cgiargs, "");
         }
-        sprintf(filename, "./public/%s", uri);
+        snprintf(filename, MAXLINE, "./public/%.*s", path_len, uri.data);
         return 0;
     }
 }
@@ -116,100 +300,187 @@ void requestGetFiletype(char *filename, char *filetype) {
         strcpy(filetype, "text/plain");
 }
 
-void requestServeDynamic(int fd, char *filename, char *cgiargs, statistics_t stats) {
-    char buf[MAXLINE], *emptylist[] = {NULL};
+void requestServeDynamic(connection_t *conn, char *filename, char *cgiargs, statistics_t stats) {
+    char *emptylist[] = {NULL};
+    char *query = conn->scratch->query;
+    response_t *response = &conn->scratch->response;
+    int fd = conn->rio->rio_fd;
 
     // The server does only a little bit of the header.
     // The CGI script has to finish writing out the header.
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
-    Rio_writen(fd, buf, strlen(buf));
-    // printf("%s", buf);
-
-    buf_stats(buf, stats, 0);
-    Rio_writen(fd, buf, strlen(buf));
+    responseStart(response, conn, "200 OK");
+    HDR_LITERAL(&response->header, "Server: OS-HW3 Web Server\r\n");
+    buf_stats(&response->header, stats, 0);
+    if (responseSend(conn, response, false) < 0)
+        return;
+
+    if (fcgiServe(filename, cgiargs, fd, conn->scratch->fcgi_content)) // a pooled process of the program did it
+        return;
+
+    // the environment of the server with the QUERY_STRING of this request
+    int env_count = 0;
+    while (environ[env_count] != NULL)
+        env_count++;
+    char *envp[env_count + 2];
+    int n = 0;
+    for (int i = 0; i < env_count; i++) {
+        if (strncmp(environ[i], "QUERY_STRING=", 13) != 0)
+            envp[n++] = environ[i];
+    }
+    snprintf(query, sizeof(conn->scratch->query), "QUERY_STRING=%s", cgiargs);
+    envp[n++] = query;
+    envp[n] = NULL;
+
+    /* When the CGI process writes to stdout, it will instead go to the socket */
+    pid_t pid = cgiSpawn(filename, emptylist, envp, fd, STDOUT_FILENO);
+    if (pid != -1 && !cgiReapLater(pid)) // asynccgi: the worker goes on, the child finishes the response
+        WaitPid(pid, NULL, 0);
+}
 
-    pid_t pid = Fork();
-    if (pid == 0) {
-        /* Child process */
-        Setenv("QUERY_STRING", cgiargs, 1);
-        /* When the CGI process writes to stdout, it will instead go to the socket */
-        Dup2(fd, STDOUT_FILENO);
-        Execve(filename, emptylist, environ);
+// Writes out the file with sendfile: the kernel copies it from the page cache to the socket without
+// mapping it into the server. Returns -1 if this pair of descriptors does not support sendfile
+// (nothing was sent then), -2 if the client went away in the middle, 0 otherwise.
+// sendfile has no MSG_NOSIGNAL, the server ignores SIGPIPE instead (see main).
+int requestSendfile(int fd, int srcfd, int filesize) {
+    off_t offset = 0;
+    while (offset < filesize) {
+        ssize_t sent = sendfile(fd, srcfd, &offset, filesize - offset);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && offset == 0 && (errno == EINVAL || errno == ENOSYS))
+            return -1;
+        if (sent == -1 && (errno == EPIPE || errno == ECONNRESET))
+            return -2;
+        if (sent == -1)
+            unix_error("Sendfile error");
+        if (sent == 0) // the file got shorter since stat, the client sees a short body
+            break;
     }
-    WaitPid(pid, NULL, 0);
+    return 0;
+}
+
+// Writes out a file straight from the cache, its fixed headers included, in a single sendmsg
+void requestServeCached(connection_t *conn, cache_entry_t *entry, statistics_t stats) {
+    response_t *response = &conn->scratch->response;
+
+    responseStart(response, conn, "200 OK");
+    hdrAppend(&response->header, entry->headers, entry->headers_len);
+    buf_stats(&response->header, stats, 1);
+    HDR_LITERAL(&response->header, "\r\n");
+    responseBody(response, entry->data, entry->size);
+    responseSend(conn, response, false);
 }
 
-void requestServeStatic(int fd, char *filename, int filesize, statistics_t stats) {
+void requestServeStatic(connection_t *conn, char *filename, struct stat *sbuf, statistics_t stats) {
     int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    char *srcp, *filetype = conn->scratch->filetype;
+    response_t *response = &conn->scratch->response;
+    int fd = conn->rio->rio_fd;
+    int filesize = sbuf->st_size;
 
     requestGetFiletype(filename, filetype);
 
-    srcfd = Open(filename, O_RDONLY, 0);
+    // files small enough are read into the cache once and served from memory from then on
+    cache_entry_t *entry = cacheInsert(filename, sbuf, filetype);
+    if (entry != NULL) {
+        requestServeCached(conn, entry, stats);
+        cacheRelease(entry);
+        return;
+    }
 
-    // Rather than call read() to read the file into memory,
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
+    srcfd = Open(filename, O_RDONLY | O_CLOEXEC, 0);
 
     // put together response
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
-    sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-Type: %s\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));
-    // printf("%s", buf);
-
-    buf_stats(buf, stats, 1);
-    sprintf(buf, "%s\r\n", buf);
-    Rio_writen(fd, buf, strlen(buf));
-
-    //  Writes out to the client socket the memory-mapped file
-    Rio_writen(fd, srcp, filesize);
-    Munmap(srcp, filesize);
+    responseStart(response, conn, "200 OK");
+    HDR_LITERAL(&response->header, "Server: OS-HW3 Web Server\r\nContent-Length: ");
+    hdrInt(&response->header, filesize);
+    HDR_LITERAL(&response->header, "\r\nContent-Type: ");
+    hdrString(&response->header, filetype);
+    HDR_LITERAL(&response->header, "\r\n");
+    buf_stats(&response->header, stats, 1);
+    HDR_LITERAL(&response->header, "\r\n");
+
+    // the header waits (MSG_MORE) to share its segment with the start of the file
+    int sent = responseSend(conn, response, filesize > 0) == 0 ? requestSendfile(fd, srcfd, filesize) : 0;
+    if (sent == -2) { // the client is gone, the rest of the body has nowhere to go
+        conn->keep_open = false;
+    } else if (sent == -1) {
+        // Rather than call read() to read the file into memory,
+        // which would require that we allocate a buffer, we memory-map the file
+        srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+        //  Writes out to the client socket the memory-mapped file
+        responseBody(response, srcp, filesize);
+        responseSend(conn, response, false);
+        Munmap(srcp, filesize);
+    }
+    Close(srcfd);
 }
 
 // handle a request (some definitions placed on h file)
 // return -<error_numver> if error has detected. when succeed, return 1 for static request and 2 for dynamic request
-int requestHandle(int fd, statistics_t stats) {
+// rio may already hold bytes of the request (read ahead by an event driven master or pipelined by the client)
+int requestHandle(connection_t *conn, statistics_t stats) {
 
     int is_static;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
-
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
-
-    // printf("%s %s %s\n", method, uri, version);
+    char *filename = conn->scratch->filename, *cgiargs = conn->scratch->cgiargs;
+    http_request_t *request = &conn->scratch->request;
+    rio_t *rio = conn->rio;
+
+    // the client closing (or timing out) between requests is the normal end of a persistent connection
+    conn->keep_open = false;
+    int header_len = requestReadHeader(rio, request);
+    if (header_len == 0)
+        return CONN_CLOSED;
+    if (header_len < 0) {
+        requestError(conn, "request header", "431", "Request Header Fields Too Large",
+                     "OS-HW3 Server could not read this", stats);
+        return ERR431;
+    }
 
-    if (strcasecmp(method, "GET")) {
-        requestError(fd, method, "501", "Not Implemented", "OS-HW3 Server does not implement this method", stats);
+    if (!httpViewIs(request->method, "GET")) {
+        // whatever follows the header is not understood, so the connection ends here
+        char *method = conn->scratch->method;
+        snprintf(method, MAXLINE, "%.*s", request->method.len, request->method.data);
+        requestError(conn, method, "501", "Not Implemented", "OS-HW3 Server does not implement this method", stats);
         return ERR501;
     }
-    requestReadhdrs(&rio);
-
-    is_static = requestParseURI(uri, filename, cgiargs);
+    bool persistent = httpViewIs(request->version, "HTTP/1.1"); // HTTP/1.0 has to ask for keep-alive
+    http_view_t *connection = httpHeader(request, "Connection");
+    if (connection != NULL && httpViewIs(*connection, "close"))
+        persistent = false;
+    else if (connection != NULL && httpViewIs(*connection, "keep-alive"))
+        persistent = true;
+    conn->keep_open = conn->keepalive && persistent && conn->requests + 1 < KEEPALIVE_MAX_REQUESTS;
+
+    is_static = requestParseURI(request->uri, filename, cgiargs);
+    if (is_static && cacheEnabled()) {
+        // a cached file was already found readable, and the cache checks it did not change since
+        cache_entry_t *entry = cacheLookup(filename);
+        if (entry != NULL) {
+            requestServeCached(conn, entry, stats);
+            cacheRelease(entry);
+            return STATIC;
+        }
+    }
     if (stat(filename, &sbuf) < 0) {
-        requestError(fd, filename, "404", "Not found", "OS-HW3 Server could not find this file", stats);
+        requestError(conn, filename, "404", "Not found", "OS-HW3 Server could not find this file", stats);
         return ERR404;
     }
 
     if (is_static) {
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            requestError(fd, filename, "403", "Forbidden", "OS-HW3 Server could not read this file", stats);
+            requestError(conn, filename, "403", "Forbidden", "OS-HW3 Server could not read this file", stats);
             return ERR403;
         }
-        requestServeStatic(fd, filename, sbuf.st_size, stats);
+        requestServeStatic(conn, filename, &sbuf, stats);
     } else {
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-            requestError(fd, filename, "403", "Forbidden", "OS-HW3 Server could not run this CGI program", stats);
+            requestError(conn, filename, "403", "Forbidden", "OS-HW3 Server could not run this CGI program", stats);
             return ERR403;
         }
-        requestServeDynamic(fd, filename, cgiargs, stats);
+        conn->keep_open = false; // the CGI output has no length the server knows, closing ends it
+        requestServeDynamic(conn, filename, cgiargs, stats);
     }
 
     return is_static;
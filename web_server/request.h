@@ -1,9 +1,23 @@
+#include "segel.h"
+#include "stdbool.h"
 #include "sys/time.h"
 
 #ifndef __REQUEST_H__
 
 // enum helper
-enum request_result { ERR501 = -501, ERR404 = -404, ERR403 = -403, DYNAMIC = 0, STATIC = 1 };
+enum request_result {
+    ERR501 = -501,
+    ERR431 = -431,
+    ERR404 = -404,
+    ERR403 = -403,
+    CONN_CLOSED = -1,
+    DYNAMIC = 0,
+    STATIC = 1
+};
+
+// persistent connections (keepalive server option)
+#define KEEPALIVE_TIMEOUT 5        // seconds a connection may wait for its next request
+#define KEEPALIVE_MAX_REQUESTS 100 // requests served on one connection before it is closed
 
 // definitions
 typedef struct timeval timeval_t;
@@ -19,6 +33,20 @@ typedef struct statistics {
 
 } statistics_t;
 
-int requestHandle(int fd, statistics_t stats);
+// memory a worker reuses for every request it handles, instead of large arrays on its stack.
+// NULL if it could not be allocated
+typedef struct request_scratch request_scratch_t;
+request_scratch_t *requestScratchCreate();
+
+typedef struct connection {
+    rio_t *rio;                 // the connection, its buffer may already hold the next (pipelined) requests
+    request_scratch_t *scratch; // of the worker handling it
+    bool keepalive;             // the server allows persistent connections
+    int requests;               // requests already served on this connection
+    bool keep_open;             // set by requestHandle: the connection may carry another request
+} connection_t;
+
+// handle the next request of the connection. CONN_CLOSED if it ended before a whole request came
+int requestHandle(connection_t *conn, statistics_t stats);
 
 #endif
@@ -328,13 +328,11 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    read() if the internal buffer is empty.
  */
 /* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_refill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
         rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-                           sizeof(rp->rio_buf));
+                           rp->rio_bufsize);
         if (rp->rio_cnt < 0) {
             if (errno != EINTR) /* interrupted by sig handler return */
                 return -1;
@@ -344,6 +342,16 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
         else 
             rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+    ssize_t rc;
+
+    if ((rc = rio_refill(rp)) <= 0)
+        return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -357,16 +365,27 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 /* $end rio_read */
 
 /*
- * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
+ * rio_readinitbuf - Associate a descriptor with the read buffer buf of the
+ *    given size. The caller owns buf, it may serve one connection after the other
  */
-/* $begin rio_readinitb */
-void rio_readinitb(rio_t *rp, int fd) 
+void rio_readinitbuf(rio_t *rp, int fd, char *buf, int size)
+{
+    rp->rio_buf = buf;
+    rp->rio_bufsize = size;
+    rio_resetb(rp, fd);
+}
+
+/*
+ * rio_resetb - Associate a descriptor with the read buffer rp already has
+ *    (from rio_readinitbuf) and reset buffer. There is no rio_readinitb any
+ *    more: rio_t does not hold its buffer, so a fresh one needs rio_readinitbuf
+ */
+void rio_resetb(rio_t *rp, int fd) 
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
     rp->rio_bufptr = rp->rio_buf;
 }
-/* $end rio_readinitb */
 
 /*
  * rio_readnb - Robustly read n bytes (buffered)
@@ -395,32 +414,69 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_readlineb - robustly read a text line (buffered). The newline is
+ *    searched for in the whole internal buffer at once (memchr) and the
+ *    line copied in one piece, not a byte per rio_read call. Returns the
+ *    number of bytes read (at most maxlen - 1, null terminated)
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0;
+    ssize_t rc;
+    char *bufp = usrbuf;
 
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
+    while (n + 1 < maxlen) {
+        if ((rc = rio_refill(rp)) < 0)
+            return -1;    /* error */
+        if (rc == 0) {
+            if (n == 0)
                 return 0; /* EOF, no data read */
             else
                 break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
+        }
+        size_t cnt = maxlen - 1 - n;
+        if (rp->rio_cnt < cnt)
+            cnt = rp->rio_cnt;
+        char *newline = memchr(rp->rio_bufptr, '\n', cnt);
+        if (newline != NULL)
+            cnt = newline - rp->rio_bufptr + 1;
+        memcpy(bufp + n, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        n += cnt;
+        if (newline != NULL)
+            break;
     }
-    *bufp = 0;
+    if (maxlen > 0)
+        bufp[n] = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_fillb - read more bytes into the internal buffer, after the unread ones
+ *    (moved to its start first, so they stay in one piece). Returns the number
+ *    of bytes read, 0 on EOF or if the buffer is full already, -1 on error
+ */
+ssize_t rio_fillb(rio_t *rp)
+{
+    ssize_t nread;
+
+    if (rp->rio_bufptr != rp->rio_buf) {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == rp->rio_bufsize)
+        return 0;
+    while ((nread = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, rp->rio_bufsize - rp->rio_cnt)) < 0) {
+        if (errno != EINTR) /* interrupted by sig handler return */
+            return -1;
+    }
+    rp->rio_cnt += nread;
+    return nread;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -439,9 +495,14 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
         unix_error("Rio_writen error");
 }
 
-void Rio_readinitb(rio_t *rp, int fd)
+void Rio_readinitbuf(rio_t *rp, int fd, char *buf, int size)
 {
-    rio_readinitb(rp, fd);
+    rio_readinitbuf(rp, fd, buf, size);
+}
+
+void Rio_resetb(rio_t *rp, int fd)
+{
+    rio_resetb(rp, fd);
 } 
 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n) 
@@ -503,12 +564,22 @@ int open_clientfd(char *hostname, int port)
  */
 /* $begin open_listenfd */
 int open_listenfd(int port) 
+{
+    return open_listenfd_reuseport(port, 0);
+}
+
+/*
+ * open_listenfd_reuseport - like open_listenfd. with reuseport set, several
+ *     sockets can listen on the same port and the kernel spreads the incoming
+ *     connections between them.
+ */
+int open_listenfd_reuseport(int port, int reuseport) 
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
   
     /* Create a socket descriptor */
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
       fprintf(stderr, "socket failed\n");
       return -1;
     }
@@ -519,6 +590,11 @@ int open_listenfd(int port)
       fprintf(stderr, "setsockopt failed\n");
       return -1;
     }
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, 
+                                (const void *)&optval , sizeof(int)) < 0) {
+      fprintf(stderr, "setsockopt failed\n");
+      return -1;
+    }
 
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
@@ -565,4 +641,13 @@ int Open_listenfd(int port)
     return rc;
 }
 
+int Open_listenfd_reuseport(int port, int reuseport) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port, reuseport)) < 0)
+        unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 
@@ -1,21 +1,61 @@
+#define _GNU_SOURCE // accept4
+#include "cache.h"
+#include "fcgi.h"
+#include "http.h"
 #include "pthread.h"
 #include "request.h"
 #include "segel.h"
 #include "stdbool.h"
+#include "uring.h"
+#include <linux/futex.h>
 #include <math.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 
 //
 // server.c: A very, very simple web server
 //
 // To run:
-//  ./server <portnum (above 2000)>
+//  ./server <portnum (above 2000)> <threads> <queue_size> <schedalg> [options...]
+//
+// Options:
+//  epoll - event driven master: connections are accepted and read without blocking, and only
+//          handed to a worker once the whole request header has arrived.
+//  keepalive - HTTP/1.1 persistent connections and pipelining. A connection is closed after
+//          KEEPALIVE_TIMEOUT idle seconds or KEEPALIVE_MAX_REQUESTS requests. Without epoll the worker
+//          waits for the next request itself; with epoll an idle connection goes back to the master.
+//  cache[=<MB>] - keep static files in memory (see cache.h). kill -USR1 prints the cache counters.
+//  lockfree - the master and the workers share a lock free ring instead of the mutex protected queue.
+//          Idle workers (and the master under the block policy) sleep on a futex, and a new request
+//          wakes a single worker. The overload policies behave the same in both queues.
+//  steal - every worker has its own queue, filled round robin by the master. A worker with an empty
+//          queue steals from its peers. The capacity and the policies apply to all of them together.
+//  acceptors=<n> - n master threads, each accepting on its own SO_REUSEPORT listening socket (and
+//          running its own event loop with epoll). With steal each one fills its own share of the
+//          worker queues. The capacity is still shared, the masters take turns at applying the policy.
+//  fcgi=<program>:<n> - keep n processes of the CGI program (a path under public) running and serve
+//          its requests on them instead of starting a process each (see fcgi.h). May be given for several programs.
+//  asynccgi - a worker does not wait for the CGI process it started. The process finishes the response
+//          on its own and a reaper thread collects it, so slow scripts do not hold workers.
+//  bufsize=<KB> - size of the read buffer of a connection, and so of the largest request header (8 KB by
+//          default). A worker reuses its buffer and its request scratch memory for every request it handles.
+//  uring - event driven master on io_uring instead of epoll: one multishot accept completes for every
+//          new connection, and the reads of request headers are submitted and reaped in batches, one
+//          io_uring_enter per round. Without io_uring support in the kernel the server uses the epoll
+//          master if that option is given too, the blocking one otherwise.
 //
 // Repeatedly handles HTTP requests sent to this port number.
 // Most of the work is done within routines written in request.c
 //
 
 #define CMD_ARGS_NUM 5
+#define EPOLL_MAX_EVENTS 64
+#define CACHE_LINE 64
 
 /*
  * Macro providing a “safe” way to invoke system calls
@@ -32,11 +72,26 @@
 // definitions
 typedef struct shared_info shared_info_t;
 typedef struct master_info master_info_t;
+typedef struct thread_info thread_info_t;
+typedef struct queue_ops queue_ops_t;
 typedef void (*overload_alg_func)(shared_info_t *, master_info_t *master_info);
 typedef struct timeval timeval_t;
 
+typedef struct pending_conn {
+    rio_t rio; // header bytes read so far by the event driven master, becomes the worker read buffer
+    timeval_t accept_time;
+    int requests;    // requests already served on this connection (keepalive)
+    time_t deadline; // closed by the master if no request has arrived by then (keepalive)
+    master_info_t *owner; // event loop of the master watching it
+    bool closing;         // uring option: timed out, freed once its read is cancelled
+    struct pending_conn *next; // also the owner's returned list (uring option)
+    struct pending_conn *prev;
+    char buf[]; // read buffer of rio, allocated with it
+} pending_conn_t;
+
 typedef struct request {
     int connfd;
+    pending_conn_t *pending; // bytes already read (epoll mode), NULL if the worker reads everything
     timeval_t arrival_time;
     timeval_t dispatch_interval;
 } request_t;
@@ -49,29 +104,112 @@ typedef struct requests_queue {
 } requests_queue_t;
 
 typedef struct requests_list {
-    request_t *items; // connfd array
-    int size;
+    request_t *items; // connfd array, a worker only writes its own entry
 } requests_list_t;
 
+// what the queues count with atomics. a finished request only updates in_flight, it takes no lock
+// unless a master waits for room (block policy).
+// the queues without a global lock (lockfree and steal options) also sleep with atomics: idle workers
+// on a futex that every push bumps, the master on one that every handled request bumps
+typedef struct queue_sync {
+    _Alignas(CACHE_LINE) atomic_uint pushes; // futex word
+    atomic_int parked;                        // workers asleep or about to be
+    _Alignas(CACHE_LINE) atomic_uint completions; // futex word
+    atomic_int masters_parked;                    // masters waiting for room, or about to
+    atomic_int in_flight; // queued + being handled, what the capacity limits
+    // acceptors option: one master at a time checks the capacity, runs the policy and pushes.
+    // the one blocked by the block policy keeps it, so at most one master sleeps on completions
+    pthread_mutex_t masters;
+} queue_sync_t;
+
+// lockfree option: bounded multi producer multi consumer ring (D. Vyukov's). the sequence of a slot
+// tells whether it is free for the push at position pos (== pos) or holds its request (== pos + 1)
+typedef struct ring_slot {
+    atomic_size_t sequence;
+    request_t request;
+} ring_slot_t;
+
+typedef struct requests_ring {
+    ring_slot_t *slots;
+    size_t mask; // number of slots - 1, a power of two
+    // the pushing and the popping side write different cache lines
+    _Alignas(CACHE_LINE) atomic_size_t tail; // next position to push
+    _Alignas(CACHE_LINE) atomic_size_t head; // next position to pop
+} requests_ring_t;
+
+// steal option: every worker has its own deque. the master fills them round robin, the owner takes
+// the oldest request and a worker with nothing to do steals the newest one of a busy peer
+typedef struct worker_deque {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock; // only the owner, the master and thieves of this deque
+    request_t *items;
+    int head; // oldest, taken by the owner
+    int tail; // next available place, thieves take the one before it
+    int size;
+} worker_deque_t;
+
+typedef struct server_options {
+    bool epoll;
+    bool keepalive;
+    size_t cache_capacity; // bytes, 0 without a cache
+    bool lockfree;
+    bool steal;
+    int acceptors; // master threads
+    // fcgi option: the programs and how many processes each
+    char *fcgi_paths[FCGI_MAX_PROGRAMS];
+    int fcgi_processes[FCGI_MAX_PROGRAMS];
+    int fcgi_count;
+    bool async_cgi;
+    bool uring;
+    int read_buffer_size; // bytes
+} server_options_t;
+
 typedef struct shared_info {
+    const queue_ops_t *queue; // operations of the queue in use
     requests_queue_t *requests_queue;
     requests_list_t *requests_list;
+    queue_sync_t *queue_sync;
+    requests_ring_t *requests_ring;  // lockfree option, NULL otherwise
+    worker_deque_t *worker_deques;   // steal option, one per worker, NULL otherwise
+    int threads_num;
     pthread_mutex_t queue_mutex;
     pthread_cond_t queue_not_full;
     pthread_cond_t queue_not_empty;
     int queue_capacity;
+    server_options_t options;
+    // event driven masters: connections waiting for a request, workers give idle ones back
+    pthread_mutex_t pending_mutex;
+    pending_conn_t *pending_head;
 
 } shared_info_t; // shared info between master and workers
 
+// a cache line per worker, so counting a request never touches a line another worker writes
 typedef struct thread_info {
-    int thread_id;
-    int requests_count;
-    int static_requests_count;
-    int dynamic_requests_count;
+    _Alignas(CACHE_LINE) int thread_id;
+    // written by the worker only, relaxed atomics so anyone may read them
+    atomic_int requests_count;
+    atomic_int static_requests_count;
+    atomic_int dynamic_requests_count;
     shared_info_t *sh_info;
     pthread_t *self;
+    // reused for every request the worker handles
+    char *read_buf; // of a connection it reads itself (not one read ahead by an event driven master)
+    request_scratch_t *scratch;
 } thread_info_t;
 
+// the request queue the master and the workers share. the overload policies only use these,
+// so they work the same on the mutex protected queue and on the lock free ring
+typedef struct queue_ops {
+    void (*lock)(shared_info_t *); // master: held while the policy runs and the request is pushed
+    void (*unlock)(shared_info_t *);
+    bool (*full)(shared_info_t *);   // queued and handled requests reached the capacity
+    int (*waiting)(shared_info_t *); // requests no worker took yet
+    void (*wait_not_full)(shared_info_t *);
+    bool (*pop)(shared_info_t *, request_t *); // the oldest waiting request, false if there is none
+    void (*push)(shared_info_t *, master_info_t *, request_t *); // by the given master
+    void (*take)(thread_info_t *, request_t *); // worker: wait for the next request
+    void (*done)(thread_info_t *);              // worker: the taken request is handled
+} queue_ops_t;
+
 typedef struct master_info {
     int listenfd;
     int clientlen;
@@ -80,6 +218,16 @@ typedef struct master_info {
     overload_alg_func policy;
     thread_info_t *workers_pool;
     timeval_t accept_time;
+    shared_info_t *sh_info;
+    int id;              // acceptors option, 0 to acceptors - 1
+    unsigned next_deque; // steal option, round robin position in this master's share of the deques
+    int epfd;            // epoll option
+    // uring option, ring is NULL without it
+    uring_t *ring;
+    bool multishot_accept; // false once the kernel turned it down
+    int wakefd;            // eventfd, workers write to it after giving a connection back
+    uint64_t wake_count;
+    pending_conn_t *returned; // given back by workers, read on again by the master (pending_mutex)
 } master_info_t;
 
 // logging and testing
@@ -141,8 +289,7 @@ void print_queue(shared_info_t *sh_info) {
     printf("\n");
 }
 
-void print_indexes(bool rand_indexes[], int n, shared_info_t *sh_info) {
-    requests_queue_t *queue = sh_info->requests_queue;
+void print_indexes(bool rand_indexes[], request_t requests[], int n) {
     bool any = false;
     printf("picked indexes:\n[");
     for (int i = 0; i < n; ++i) {
@@ -158,7 +305,7 @@ void print_indexes(bool rand_indexes[], int n, shared_info_t *sh_info) {
     printf("picked values:\n[");
     for (int i = 0; i < n; ++i) {
         if (rand_indexes[i]) {
-            printf("%d, ", queue->items[(queue->head + i) % sh_info->queue_capacity].connfd);
+            printf("%d, ", requests[i].connfd);
             any = true;
         }
     }
@@ -166,42 +313,383 @@ void print_indexes(bool rand_indexes[], int n, shared_info_t *sh_info) {
         printf("\b\b");
     printf("]\n");
 }
+
+void setNonBlocking(int fd, bool non_blocking) {
+    int flags;
+    DO_SYS(flags = fcntl(fd, F_GETFL));
+    flags = non_blocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    DO_SYS(fcntl(fd, F_SETFL, flags));
+}
+
+// close a request that will never reach a worker
+void dropRequest(request_t *request) {
+    Close(request->connfd);
+    free(request->pending);
+}
+
+// counting without the mutex, and sleeping without it (lockfree and steal options)
+
+void futexWait(atomic_uint *word, unsigned expected) {
+    // returns at once if the word changed since expected was read, callers recheck anyway
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void futexWake(atomic_uint *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// workers never take this lock. with a single master there is no one to lock out
+void syncLock(shared_info_t *sh_info) {
+    if (sh_info->options.acceptors > 1)
+        pthread_mutex_lock(&sh_info->queue_sync->masters);
+}
+
+void syncUnlock(shared_info_t *sh_info) {
+    if (sh_info->options.acceptors > 1)
+        pthread_mutex_unlock(&sh_info->queue_sync->masters);
+}
+
+bool syncFull(shared_info_t *sh_info) {
+    return atomic_load(&sh_info->queue_sync->in_flight) >= sh_info->queue_capacity;
+}
+
+// the sleeping side announces itself before its last look and the waking side publishes before it
+// looks for sleepers (all seq_cst), so one of them always sees the other
+void syncWaitNotFull(shared_info_t *sh_info) {
+    queue_sync_t *sync = sh_info->queue_sync;
+    atomic_fetch_add(&sync->masters_parked, 1);
+    unsigned seen = atomic_load(&sync->completions);
+    if (syncFull(sh_info))
+        futexWait(&sync->completions, seen);
+    atomic_fetch_sub(&sync->masters_parked, 1);
+}
+
+// a request was published
+void syncPushed(queue_sync_t *sync) {
+    atomic_fetch_add(&sync->pushes, 1);
+    if (atomic_load(&sync->parked) > 0)
+        futexWake(&sync->pushes); // one worker, the others keep sleeping
+}
+
+// sleep until try_take finds a request
+void syncTake(thread_info_t *thread_info, request_t *request, bool (*try_take)(thread_info_t *, request_t *)) {
+    shared_info_t *sh_info = thread_info->sh_info;
+    queue_sync_t *sync = sh_info->queue_sync;
+    while (!try_take(thread_info, request)) {
+        atomic_fetch_add(&sync->parked, 1);
+        unsigned seen = atomic_load(&sync->pushes);
+        bool taken = try_take(thread_info, request);
+        if (!taken) {
+            LOG(printf("worker %d wait\n", thread_info->thread_id));
+            futexWait(&sync->pushes, seen);
+        }
+        atomic_fetch_sub(&sync->parked, 1);
+        if (taken)
+            break;
+    }
+    // only this worker writes its list entry
+    sh_info->requests_list->items[thread_info->thread_id] = *request;
+}
+
+void syncDone(thread_info_t *thread_info) {
+    shared_info_t *sh_info = thread_info->sh_info;
+    queue_sync_t *sync = sh_info->queue_sync;
+    sh_info->requests_list->items[thread_info->thread_id].connfd = -1;
+    atomic_fetch_sub(&sync->in_flight, 1);
+    atomic_fetch_add(&sync->completions, 1);
+    if (atomic_load(&sync->masters_parked) > 0)
+        futexWake(&sync->completions);
+}
+
+// mutex protected queue (default)
+
+void mutexLock(shared_info_t *sh_info) {
+    pthread_mutex_lock(&sh_info->queue_mutex);
+}
+
+void mutexUnlock(shared_info_t *sh_info) {
+    pthread_mutex_unlock(&sh_info->queue_mutex);
+}
+
+int mutexWaiting(shared_info_t *sh_info) {
+    return sh_info->requests_queue->size;
+}
+
+// workers see masters_parked before they skip the signal, see syncWaitNotFull
+void mutexWaitNotFull(shared_info_t *sh_info) {
+    queue_sync_t *sync = sh_info->queue_sync;
+    atomic_fetch_add(&sync->masters_parked, 1);
+    if (syncFull(sh_info))
+        pthread_cond_wait(&sh_info->queue_not_full, &sh_info->queue_mutex);
+    atomic_fetch_sub(&sync->masters_parked, 1);
+}
+
+bool mutexPop(shared_info_t *sh_info, request_t *request) {
+    requests_queue_t *queue = sh_info->requests_queue;
+    if (queue->size == 0)
+        return false;
+    *request = queue->items[queue->head];
+    queue->head = (queue->head + 1) % sh_info->queue_capacity;
+    queue->size -= 1;
+    return true;
+}
+
+// taken out by the master (policy), not by a worker
+bool mutexDrop(shared_info_t *sh_info, request_t *request) {
+    if (!mutexPop(sh_info, request))
+        return false;
+    atomic_fetch_sub(&sh_info->queue_sync->in_flight, 1);
+    return true;
+}
+
+void mutexPush(shared_info_t *sh_info, master_info_t *master_info, request_t *request) {
+    requests_queue_t *queue = sh_info->requests_queue;
+    queue->items[queue->tail] = *request;
+    queue->tail = (queue->tail + 1) % sh_info->queue_capacity;
+    queue->size += 1;
+    atomic_fetch_add(&sh_info->queue_sync->in_flight, 1);
+    TEST(assert(check_queue(queue->head, queue->tail, queue->size, sh_info->queue_capacity)));
+    pthread_cond_broadcast(&sh_info->queue_not_empty);
+}
+
+void mutexTake(thread_info_t *thread_info, request_t *request) {
+    shared_info_t *sh_info = thread_info->sh_info;
+    pthread_mutex_lock(&sh_info->queue_mutex);
+    while (sh_info->requests_queue->size == 0) {
+        LOG(printf("worker %d wait\n", thread_info->thread_id));
+        pthread_cond_wait(&sh_info->queue_not_empty, &sh_info->queue_mutex);
+    }
+    mutexPop(sh_info, request);
+    TEST(assert(check_queue(sh_info->requests_queue->head, sh_info->requests_queue->tail,
+                            sh_info->requests_queue->size, sh_info->queue_capacity)));
+    pthread_mutex_unlock(&sh_info->queue_mutex);
+    // insert to list. thread always use the list index which equals to its id
+    sh_info->requests_list->items[thread_info->thread_id] = *request;
+}
+
+void mutexDone(thread_info_t *thread_info) {
+    shared_info_t *sh_info = thread_info->sh_info;
+    // remove request from list
+    sh_info->requests_list->items[thread_info->thread_id].connfd = -1;
+    atomic_fetch_sub(&sh_info->queue_sync->in_flight, 1);
+    if (atomic_load(&sh_info->queue_sync->masters_parked) > 0) {
+        // the lock makes sure the master is inside pthread_cond_wait, not just about to be
+        pthread_mutex_lock(&sh_info->queue_mutex);
+        pthread_cond_signal(&sh_info->queue_not_full);
+        pthread_mutex_unlock(&sh_info->queue_mutex);
+    }
+}
+
+const queue_ops_t mutex_queue = {mutexLock, mutexUnlock, syncFull,  mutexWaiting, mutexWaitNotFull,
+                                 mutexDrop, mutexPush,   mutexTake, mutexDone};
+
+// lock free ring (lockfree option)
+
+bool ringPush(requests_ring_t *ring, request_t *request) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (1) {
+        ring_slot_t *slot = &ring->slots[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                slot->request = *request;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // the slot is still read from a lap ago
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+bool ringPop(requests_ring_t *ring, request_t *request) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (1) {
+        ring_slot_t *slot = &ring->slots[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *request = slot->request;
+                atomic_store_explicit(&slot->sequence, pos + ring->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // empty
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+}
+
+int lockfreeWaiting(shared_info_t *sh_info) {
+    size_t head = atomic_load(&sh_info->requests_ring->head); // first, so it can not pass the tail
+    return atomic_load(&sh_info->requests_ring->tail) - head;
+}
+
+bool lockfreePop(shared_info_t *sh_info, request_t *request) {
+    if (!ringPop(sh_info->requests_ring, request))
+        return false;
+    atomic_fetch_sub(&sh_info->queue_sync->in_flight, 1);
+    return true;
+}
+
+void lockfreePush(shared_info_t *sh_info, master_info_t *master_info, request_t *request) {
+    atomic_fetch_add(&sh_info->queue_sync->in_flight, 1);
+    // there are at least queue_capacity slots, a slot only looks taken while a pop is finishing it
+    while (!ringPush(sh_info->requests_ring, request))
+        sched_yield();
+    syncPushed(sh_info->queue_sync);
+}
+
+bool lockfreeTryTake(thread_info_t *thread_info, request_t *request) {
+    return ringPop(thread_info->sh_info->requests_ring, request);
+}
+
+void lockfreeTake(thread_info_t *thread_info, request_t *request) {
+    syncTake(thread_info, request, lockfreeTryTake);
+}
+
+const queue_ops_t lockfree_queue = {syncLock,    syncUnlock,   syncFull,     lockfreeWaiting, syncWaitNotFull,
+                                    lockfreePop, lockfreePush, lockfreeTake, syncDone};
+
+// per worker deques (steal option)
+
+// take the oldest (from_head) or the newest request of a deque
+bool dequeTake(shared_info_t *sh_info, worker_deque_t *deque, bool from_head, request_t *request) {
+    pthread_mutex_lock(&deque->lock);
+    bool taken = deque->size > 0;
+    if (taken) {
+        if (from_head) {
+            *request = deque->items[deque->head];
+            deque->head = (deque->head + 1) % sh_info->queue_capacity;
+        } else {
+            deque->tail = (deque->tail + sh_info->queue_capacity - 1) % sh_info->queue_capacity;
+            *request = deque->items[deque->tail];
+        }
+        deque->size -= 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+int stealWaiting(shared_info_t *sh_info) {
+    int waiting = 0;
+    for (int i = 0; i < sh_info->threads_num; i++) {
+        pthread_mutex_lock(&sh_info->worker_deques[i].lock);
+        waiting += sh_info->worker_deques[i].size;
+        pthread_mutex_unlock(&sh_info->worker_deques[i].lock);
+    }
+    return waiting;
+}
+
+// the oldest waiting request of all the deques
+bool stealPop(shared_info_t *sh_info, request_t *request) {
+    while (1) {
+        worker_deque_t *oldest = NULL;
+        timeval_t oldest_time;
+        for (int i = 0; i < sh_info->threads_num; i++) {
+            worker_deque_t *deque = &sh_info->worker_deques[i];
+            pthread_mutex_lock(&deque->lock);
+            if (deque->size > 0) {
+                timeval_t arrival = deque->items[deque->head].arrival_time;
+                if (oldest == NULL || timercmp(&arrival, &oldest_time, <)) {
+                    oldest = deque;
+                    oldest_time = arrival;
+                }
+            }
+            pthread_mutex_unlock(&deque->lock);
+        }
+        if (oldest == NULL)
+            return false;
+        // its owner may have taken it meanwhile, then look again
+        if (dequeTake(sh_info, oldest, true, request)) {
+            atomic_fetch_sub(&sh_info->queue_sync->in_flight, 1);
+            return true;
+        }
+    }
+}
+
+void stealPush(shared_info_t *sh_info, master_info_t *master_info, request_t *request) {
+    atomic_fetch_add(&sh_info->queue_sync->in_flight, 1);
+    // a deque can not overflow, all of them together hold at most queue_capacity requests.
+    // master i fills deques i, i + acceptors, ... so several masters rarely meet at one deque lock
+    worker_deque_t *deque = &sh_info->worker_deques[master_info->next_deque % sh_info->threads_num];
+    master_info->next_deque += sh_info->options.acceptors;
+    pthread_mutex_lock(&deque->lock);
+    deque->items[deque->tail] = *request;
+    deque->tail = (deque->tail + 1) % sh_info->queue_capacity;
+    deque->size += 1;
+    pthread_mutex_unlock(&deque->lock);
+    syncPushed(sh_info->queue_sync);
+}
+
+// own deque first, then the newest request of the peers, starting with the next one
+bool stealTryTake(thread_info_t *thread_info, request_t *request) {
+    shared_info_t *sh_info = thread_info->sh_info;
+    int id = thread_info->thread_id;
+    if (dequeTake(sh_info, &sh_info->worker_deques[id], true, request))
+        return true;
+    for (int i = 1; i < sh_info->threads_num; i++) {
+        if (dequeTake(sh_info, &sh_info->worker_deques[(id + i) % sh_info->threads_num], false, request)) {
+            LOG(printf("worker %d stole request %d\n", id, request->connfd));
+            return true;
+        }
+    }
+    return false;
+}
+
+void stealTake(thread_info_t *thread_info, request_t *request) {
+    syncTake(thread_info, request, stealTryTake);
+}
+
+const queue_ops_t steal_queue = {syncLock, syncUnlock, syncFull,  stealWaiting, syncWaitNotFull,
+                                 stealPop, stealPush,  stealTake, syncDone};
+
 // overload policies
 void block(shared_info_t *sh_info, master_info_t *master_info) {
     LOG(printf("master waits\n"));
-    pthread_cond_wait(&sh_info->queue_not_full, &sh_info->queue_mutex);
+    sh_info->queue->wait_not_full(sh_info);
 }
 
+// drops the new connection, the master goes on with the next one
 void drop_tail(shared_info_t *sh_info, master_info_t *master_info) {
-    pthread_mutex_unlock(&sh_info->queue_mutex);
     LOG(printf("dropping tail\n"));
     Close(master_info->connfd);
-    master_info->connfd =
-        Accept(master_info->listenfd, (SA *)&master_info->clientaddr, (socklen_t *)&master_info->clientlen);
-    DO_SYS(gettimeofday(&(master_info->accept_time), NULL));
-    pthread_mutex_lock(&sh_info->queue_mutex);
+    master_info->connfd = -1;
 }
 
 void drop_head(shared_info_t *sh_info, master_info_t *master_info) {
-    if (sh_info->requests_queue->size == 0)
+    request_t head_req;
+    if (!sh_info->queue->pop(sh_info, &head_req))
         drop_tail(sh_info, master_info);
     else {
-        LOG(printf("dropping head %d\n", sh_info->requests_queue->items[sh_info->requests_queue->head].connfd));
-        Close(sh_info->requests_queue->items[sh_info->requests_queue->head].connfd);
-        sh_info->requests_queue->head = (sh_info->requests_queue->head + 1) % sh_info->queue_capacity;
-        sh_info->requests_queue->size -= 1;
+        LOG(printf("dropping head %d\n", head_req.connfd));
+        dropRequest(&head_req);
     }
 }
 
 void drop_random(shared_info_t *sh_info, master_info_t *master_info) {
-    if (sh_info->requests_queue->size == 0)
+    int n = sh_info->queue->waiting(sh_info);
+    if (n == 0)
         drop_tail(sh_info, master_info);
     else {
         LOG(printf("dropping 50%% of the requests randomly\n"));
+        // take the waiting requests out in order. with the lock free ring workers may take some meanwhile
+        request_t waiting[n];
+        int taken = 0;
+        while (taken < n && sh_info->queue->pop(sh_info, &waiting[taken]))
+            taken += 1;
+        n = taken;
+
         // initialize arrays.
         // rand_indexes store the result random indexes keeping it ordered without the need to sort
         // indexes store all the indexes fom 0 to n-1 to randomly pick from
-        int n = sh_info->requests_queue->size;
         bool rand_indexes[n];
         int indexes[n];
         for (int i = 0; i < n; ++i) {
@@ -209,7 +697,6 @@ void drop_random(shared_info_t *sh_info, master_info_t *master_info) {
             rand_indexes[i] = false;
         }
         srand(time(NULL)); // Seed the random number generator
-        LOG(printf("queue before:\n"); print_queue(sh_info););
 
         // pick n/2 indexes (that will be kept) randomly using pick and swap algorithm
         int limit = n / 2; // floor of the number to keep is ceil of the number to remove.
@@ -220,48 +707,125 @@ void drop_random(shared_info_t *sh_info, master_info_t *master_info) {
             indexes[index] = indexes[n - i - 1]; // swap
             indexes[n - i - 1] = temp;
         }
-        LOG(print_indexes(rand_indexes, n, sh_info));
+        LOG(print_indexes(rand_indexes, waiting, n));
 
-        // drop unpicked items from the queue by moving all picked items to the head one bt one while keeping the order
-        int head = sh_info->requests_queue->head;
-        int tail = head;
+        // put the picked requests back in their order and drop the rest
         for (int i = 0; i < n; ++i) {
-            if (rand_indexes[i] == true) {
-                sh_info->requests_queue->items[tail] =
-                    sh_info->requests_queue->items[(head + i) % sh_info->queue_capacity];
-                // TEST(sh_info->requests_queue->items[(head + i) % sh_info->queue_capacity].connfd = -1;); // for
-                // dropped test TODO
-                tail = (tail + 1) % sh_info->queue_capacity;
-            } else
-                Close(sh_info->requests_queue->items[(head + i) % sh_info->queue_capacity].connfd);
+            if (rand_indexes[i] == true)
+                sh_info->queue->push(sh_info, master_info, &waiting[i]);
+            else
+                dropRequest(&waiting[i]);
         }
-        sh_info->requests_queue->tail = tail;
-        sh_info->requests_queue->size = limit;
-        LOG(printf("queue after:\n"); print_queue(sh_info););
-        TEST(assert(check_queue(head, tail, limit, sh_info->queue_capacity))); // test size match head and tail values
-        // TEST(for (int i = 0; i != n - limit; i = (i + 1) % sh_info->queue_capacity) {
-        //     // assert if dropped file not closed
-        //     assert(close(sh_info->requests_queue->items[tail + i].connfd) == -1);
-        // }); TODO
     }
 }
 
+// keepalive helpers
+
+void setReadTimeout(int fd, int seconds) {
+    struct timeval timeout = {.tv_sec = seconds, .tv_usec = 0};
+    DO_SYS(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+}
+
+// wait up to KEEPALIVE_TIMEOUT for the next request on a persistent connection and stamp its arrival.
+// false if the client went quiet (or away) instead
+bool waitNextRequest(rio_t *rio, timeval_t *arrival_time) {
+    if (rio->rio_cnt == 0) {
+        struct pollfd readable = {.fd = rio->rio_fd, .events = POLLIN};
+        int ready;
+        while ((ready = poll(&readable, 1, KEEPALIVE_TIMEOUT * 1000)) == -1 && errno == EINTR)
+            ;
+        if (ready <= 0)
+            return false;
+    }
+    DO_SYS(gettimeofday(arrival_time, NULL));
+    return true;
+}
+
+// one writer: a plain load and store, no locked read-modify-write
+void counterAdd(atomic_int *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+// add the statistics of one finished request to its worker
+void countRequest(thread_info_t *thread_info, int result) {
+    counterAdd(&thread_info->requests_count);
+    if (result == STATIC)
+        counterAdd(&thread_info->static_requests_count);
+    if (result == DYNAMIC)
+        counterAdd(&thread_info->dynamic_requests_count);
+}
+
+// the counters of the worker before the request it is about to handle
+void stampCounters(thread_info_t *thread_info, statistics_t *stats) {
+    stats->requests_count = atomic_load_explicit(&thread_info->requests_count, memory_order_relaxed);
+    stats->static_requests_count = atomic_load_explicit(&thread_info->static_requests_count, memory_order_relaxed);
+    stats->dynamic_requests_count = atomic_load_explicit(&thread_info->dynamic_requests_count, memory_order_relaxed);
+}
+
+// the list of connections waiting for a request (caller holds pending_mutex)
+void linkPending(shared_info_t *sh_info, pending_conn_t *pending) {
+    pending->prev = NULL;
+    pending->next = sh_info->pending_head;
+    if (pending->next != NULL)
+        pending->next->prev = pending;
+    sh_info->pending_head = pending;
+}
+
+// caller holds pending_mutex
+void unlinkPending(shared_info_t *sh_info, pending_conn_t *pending) {
+    if (pending->prev != NULL)
+        pending->prev->next = pending->next;
+    else
+        sh_info->pending_head = pending->next;
+    if (pending->next != NULL)
+        pending->next->prev = pending->prev;
+}
+
+// start watching a connection for its next request (caller holds pending_mutex)
+void watchPending(shared_info_t *sh_info, pending_conn_t *pending) {
+    pending->deadline = time(NULL) + KEEPALIVE_TIMEOUT;
+    linkPending(sh_info, pending);
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = pending};
+    DO_SYS(epoll_ctl(pending->owner->epfd, EPOLL_CTL_ADD, pending->rio.rio_fd, &event));
+}
+
+// caller holds pending_mutex
+void unwatchPending(shared_info_t *sh_info, pending_conn_t *pending) {
+    DO_SYS(epoll_ctl(pending->owner->epfd, EPOLL_CTL_DEL, pending->rio.rio_fd, NULL));
+    unlinkPending(sh_info, pending);
+}
+
+// a worker returns an idle persistent connection to the event driven master
+void giveBack(shared_info_t *sh_info, pending_conn_t *pending, int requests) {
+    pending->requests = requests;
+    Rio_resetb(&pending->rio, pending->rio.rio_fd);
+    master_info_t *owner = pending->owner;
+    if (owner->ring != NULL) {
+        // only the master submits to its ring: queue the connection and wake it
+        pthread_mutex_lock(&sh_info->pending_mutex);
+        pending->deadline = time(NULL) + KEEPALIVE_TIMEOUT;
+        pending->next = owner->returned;
+        owner->returned = pending;
+        pthread_mutex_unlock(&sh_info->pending_mutex);
+        uint64_t one = 1;
+        DO_SYS(write(owner->wakefd, &one, sizeof(one)));
+        return;
+    }
+    setNonBlocking(pending->rio.rio_fd, true);
+    // registered under the lock, so the master never sees it in the list but not yet in epoll
+    pthread_mutex_lock(&sh_info->pending_mutex);
+    watchPending(sh_info, pending);
+    pthread_mutex_unlock(&sh_info->pending_mutex);
+}
+
 // threads functions
 void *workerFunction(void *info) {
     thread_info_t *thread_info = info;
     shared_info_t *sh_info = thread_info->sh_info;
     LOG(printf("worker %d started\n", thread_info->thread_id));
     while (1) {
-        // check that the queue not empty
-        pthread_mutex_lock(&sh_info->queue_mutex);
-        while (sh_info->requests_queue->size == 0) {
-            LOG(printf("worker %d wait\n", thread_info->thread_id));
-            pthread_cond_wait(&sh_info->queue_not_empty, &sh_info->queue_mutex);
-        }
-        // take head out of queue
-        request_t head_req = sh_info->requests_queue->items[sh_info->requests_queue->head];
-        sh_info->requests_queue->head = (sh_info->requests_queue->head + 1) % sh_info->queue_capacity;
-        sh_info->requests_queue->size -= 1;
+        request_t head_req;
+        sh_info->queue->take(thread_info, &head_req);
 
         // stamp dispatch_interval
         timeval_t temp;
@@ -273,77 +837,441 @@ void *workerFunction(void *info) {
             head_req.dispatch_interval.tv_usec += 1000000;
         }
 
-        // insert to list. thread always use the list index which equals to its id
-        sh_info->requests_list->items[thread_info->thread_id] = head_req;
-        sh_info->requests_list->size += 1;
-
         // create statistics stamp
         statistics_t stats_stamp;
         stats_stamp.thread_id = thread_info->thread_id;
-        stats_stamp.requests_count = thread_info->requests_count;
-        stats_stamp.static_requests_count = thread_info->static_requests_count;
-        stats_stamp.dynamic_requests_count = thread_info->dynamic_requests_count;
+        stampCounters(thread_info, &stats_stamp);
         stats_stamp.arrival_time = head_req.arrival_time;
         stats_stamp.dispatch_interval = head_req.dispatch_interval;
         LOG(printf("worker %d piked request %d\n", thread_info->thread_id, head_req.connfd));
-        pthread_cond_signal(&sh_info->queue_not_full);
-        pthread_mutex_unlock(&sh_info->queue_mutex);
 
-        // handle request
+        // handle request, and the ones following it on a persistent connection
         TEST(usleep(100000));
-        int result = requestHandle(head_req.connfd, stats_stamp);
-        Close(head_req.connfd);
-
-        pthread_mutex_lock(&sh_info->queue_mutex);
-        // update statistics
-        thread_info->requests_count += 1;
-        if (result == STATIC)
-            thread_info->static_requests_count += 1;
-        if (result == DYNAMIC)
-            thread_info->dynamic_requests_count += 1;
-        // remove request from list
-        sh_info->requests_list->items[thread_info->thread_id].connfd = -1;
-        sh_info->requests_list->size -= 1;
-        TEST(assert(check_queue(sh_info->requests_queue->head, sh_info->requests_queue->tail,
-                                sh_info->requests_queue->size, sh_info->queue_capacity)));
+        rio_t own_rio;
+        connection_t conn = {&own_rio, thread_info->scratch, sh_info->options.keepalive, 0, false};
+        if (head_req.pending != NULL) {
+            conn.rio = &head_req.pending->rio;
+            conn.requests = head_req.pending->requests;
+        } else {
+            Rio_readinitbuf(conn.rio, head_req.connfd, thread_info->read_buf, sh_info->options.read_buffer_size);
+        }
+        if (conn.keepalive)
+            setReadTimeout(head_req.connfd, KEEPALIVE_TIMEOUT); // a stalled request does not hold the worker forever
+        bool handed_back = false;
+        while (1) {
+            int result = requestHandle(&conn, stats_stamp);
+            if (result == CONN_CLOSED)
+                break;
+            conn.requests += 1;
+            countRequest(thread_info, result);
+            if (!conn.keep_open)
+                break;
+            if (head_req.pending != NULL && conn.rio->rio_cnt == 0) {
+                // nothing pipelined: the master watches the idle connection instead of this worker
+                giveBack(sh_info, head_req.pending, conn.requests);
+                handed_back = true;
+                break;
+            }
+            if (!waitNextRequest(conn.rio, &stats_stamp.arrival_time))
+                break;
+            // the next request was never queued, it is dispatched the moment it arrives
+            stats_stamp.dispatch_interval.tv_sec = 0;
+            stats_stamp.dispatch_interval.tv_usec = 0;
+            stampCounters(thread_info, &stats_stamp);
+        }
+        if (!handed_back) {
+            Close(head_req.connfd);
+            free(head_req.pending);
+        }
+        sh_info->queue->done(thread_info);
         LOG(printf("worker %d handle request %d\n", thread_info->thread_id, head_req.connfd));
-        pthread_cond_signal(&sh_info->queue_not_full);
-        pthread_mutex_unlock(&sh_info->queue_mutex);
     }
 }
 
-void runMaster(int port, shared_info_t *sh_info, master_info_t *master_info) {
+// queue master_info->connfd for the workers, applying the overload policy while the queue is full.
+// the policy may drop the new connection itself (connfd becomes -1), then pending is freed here.
+void enqueueRequest(shared_info_t *sh_info, master_info_t *master_info, pending_conn_t *pending) {
+    const queue_ops_t *queue = sh_info->queue;
+    // check that the queue not full
+    queue->lock(sh_info);
+    while (master_info->connfd != -1 && queue->full(sh_info)) {
+        master_info->policy(sh_info, master_info);
+    }
+    if (master_info->connfd == -1) {
+        queue->unlock(sh_info);
+        free(pending);
+        return;
+    }
+
+    // Save the relevant info in a buffer and have one of the worker threads do the work.
+    request_t request = {.connfd = master_info->connfd, .pending = pending, .arrival_time = master_info->accept_time};
+    queue->push(sh_info, master_info, &request);
+    LOG(printf("master add request connfd %d\n", master_info->connfd));
+    queue->unlock(sh_info);
+}
+
+void runMaster(shared_info_t *sh_info, master_info_t *master_info) {
     master_info->clientlen = sizeof(master_info->clientaddr);
     while (1) {
         // wait for request
-        master_info->connfd =
-            Accept(master_info->listenfd, (SA *)&master_info->clientaddr, (socklen_t *)&master_info->clientlen);
+        // close on exec, a CGI program started meanwhile must not hold other clients' connections open
+        DO_SYS(master_info->connfd = accept4(master_info->listenfd, (SA *)&master_info->clientaddr,
+                                             (socklen_t *)&master_info->clientlen, SOCK_CLOEXEC));
         DO_SYS(gettimeofday(&(master_info->accept_time), NULL));
+        enqueueRequest(sh_info, master_info, NULL);
+    }
+}
 
-        // check that the queue not full
-        pthread_mutex_lock(&sh_info->queue_mutex);
-        while (sh_info->requests_queue->size + sh_info->requests_list->size == sh_info->queue_capacity) {
-            master_info->policy(sh_info, master_info);
+// event driven master (epoll option)
+
+// a connection just accepted by the master, with its read buffer. NULL if there is no memory for it,
+// the connection is closed then
+pending_conn_t *createPending(shared_info_t *sh_info, master_info_t *master_info, int connfd) {
+    int size = sh_info->options.read_buffer_size;
+    pending_conn_t *pending = malloc(sizeof(pending_conn_t) + size);
+    if (pending == NULL) {
+        perror("malloc");
+        Close(connfd);
+        return NULL;
+    }
+    DO_SYS(gettimeofday(&pending->accept_time, NULL));
+    Rio_readinitbuf(&pending->rio, connfd, pending->buf, size);
+    pending->requests = 0;
+    pending->owner = master_info;
+    pending->closing = false;
+    return pending;
+}
+
+// accept every connection waiting on the (non blocking) listening socket and watch it for input
+void acceptPending(shared_info_t *sh_info, master_info_t *master_info) {
+    while (1) {
+        master_info->clientlen = sizeof(master_info->clientaddr);
+        int connfd =
+            accept4(master_info->listenfd, (SA *)&master_info->clientaddr, (socklen_t *)&master_info->clientlen,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4"); // e.g. out of descriptors, the rest stay in the backlog
+            return;
         }
+        pending_conn_t *pending = createPending(sh_info, master_info, connfd);
+        if (pending == NULL)
+            continue;
+        pthread_mutex_lock(&sh_info->pending_mutex);
+        watchPending(sh_info, pending);
+        pthread_mutex_unlock(&sh_info->pending_mutex);
+    }
+}
 
-        // Save the relevant info in a buffer and have one of the worker threads do the work.
-        request_t *tail_req = &sh_info->requests_queue->items[sh_info->requests_queue->tail];
-        tail_req->arrival_time = master_info->accept_time;
-        tail_req->connfd = master_info->connfd;
-        sh_info->requests_queue->tail = (sh_info->requests_queue->tail + 1) % sh_info->queue_capacity;
-        sh_info->requests_queue->size += 1;
-        TEST(assert(check_queue(sh_info->requests_queue->head, sh_info->requests_queue->tail,
-                                sh_info->requests_queue->size, sh_info->queue_capacity)));
-        LOG(printf("master add request connfd %d\n", master_info->connfd));
-        pthread_cond_broadcast(&sh_info->queue_not_empty);
-        pthread_mutex_unlock(&sh_info->queue_mutex);
+// read what arrived on a pending connection; once the header is complete hand it to the workers
+void readPending(shared_info_t *sh_info, master_info_t *master_info, pending_conn_t *pending) {
+    rio_t *rio = &pending->rio;
+    int checked = rio->rio_cnt;
+    bool closed = false;
+    while (rio->rio_cnt < rio->rio_bufsize) { // edge triggered: read until the socket is drained
+        ssize_t n = recv(rio->rio_fd, rio->rio_buf + rio->rio_cnt, rio->rio_bufsize - rio->rio_cnt, 0);
+        if (n > 0) {
+            rio->rio_cnt += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            closed = !(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+            break;
+        }
+    }
+
+    // the next request of a kept alive connection arrives now, not when the connection was accepted
+    if (pending->requests > 0 && checked == 0 && rio->rio_cnt > 0)
+        DO_SYS(gettimeofday(&pending->accept_time, NULL));
+
+    // a full buffer without the end of the header is handed over as well, the worker reads the rest
+    bool ready = httpHeaderEnd(rio->rio_buf, checked, rio->rio_cnt) > 0 || rio->rio_cnt == rio->rio_bufsize;
+    if (!ready && !closed)
+        return;
+    pthread_mutex_lock(&sh_info->pending_mutex);
+    unwatchPending(sh_info, pending);
+    pthread_mutex_unlock(&sh_info->pending_mutex);
+    if (!ready) { // the client went away before sending a request, there is no one to answer
+        Close(rio->rio_fd);
+        free(pending);
+        return;
+    }
+    setNonBlocking(rio->rio_fd, false); // workers use blocking I/O
+    master_info->connfd = rio->rio_fd;
+    master_info->accept_time = pending->accept_time;
+    enqueueRequest(sh_info, master_info, pending);
+}
+
+// every waiting connection costs a descriptor, not a worker, so allow as many as the hard limit does
+void raiseDescriptorLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// keepalive: close the connections of this master that waited too long for a request.
+// the other masters may be handling events of theirs right now
+void closeIdlePending(shared_info_t *sh_info, master_info_t *master_info) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&sh_info->pending_mutex);
+    pending_conn_t *pending = sh_info->pending_head;
+    while (pending != NULL) {
+        pending_conn_t *next = pending->next;
+        if (pending->owner == master_info && pending->deadline <= now) {
+            unwatchPending(sh_info, pending);
+            Close(pending->rio.rio_fd);
+            free(pending);
+        }
+        pending = next;
+    }
+    pthread_mutex_unlock(&sh_info->pending_mutex);
+}
+
+void runEventMaster(shared_info_t *sh_info, master_info_t *master_info) {
+    raiseDescriptorLimit();
+    DO_SYS(master_info->epfd = epoll_create1(EPOLL_CLOEXEC));
+    setNonBlocking(master_info->listenfd, true);
+    struct epoll_event listen_event = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+    DO_SYS(epoll_ctl(master_info->epfd, EPOLL_CTL_ADD, master_info->listenfd, &listen_event));
+
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    while (1) {
+        // idle connections are swept before waiting, so no event below refers to a closed one
+        if (sh_info->options.keepalive)
+            closeIdlePending(sh_info, master_info);
+        int ready = epoll_wait(master_info->epfd, events, EPOLL_MAX_EVENTS, sh_info->options.keepalive ? 1000 : -1);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        DO_SYS(ready);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL)
+                acceptPending(sh_info, master_info);
+            else
+                readPending(sh_info, master_info, events[i].data.ptr);
+        }
+    }
+}
+
+// io_uring master (uring option)
+
+#define URING_ENTRIES 256
+// user_data of the completions that do not belong to a pending connection's read
+#define URING_ACCEPT 1
+#define URING_WAKE 2
+#define URING_TICK 3
+#define URING_CANCEL 4
+
+// a submission entry of the master's ring, the queued ones are submitted first if it is full
+struct io_uring_sqe *uringNextSqe(uring_t *ring) {
+    struct io_uring_sqe *sqe;
+    while ((sqe = uringGetSqe(ring)) == NULL)
+        DO_SYS(uringSubmit(ring, 0));
+    return sqe;
+}
+
+void uringAccept(master_info_t *master_info) {
+    struct io_uring_sqe *sqe = uringNextSqe(master_info->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = master_info->listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC; // blocking, the way the workers use it
+    if (master_info->multishot_accept)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT; // stays armed, a completion per connection
+    sqe->user_data = URING_ACCEPT;
+}
+
+// read the next bytes of the request header straight into the buffer the worker will read from
+void uringRecv(shared_info_t *sh_info, pending_conn_t *pending) {
+    pthread_mutex_lock(&sh_info->pending_mutex); // in the list exactly while its read is in flight
+    linkPending(sh_info, pending);
+    pthread_mutex_unlock(&sh_info->pending_mutex);
+    rio_t *rio = &pending->rio;
+    struct io_uring_sqe *sqe = uringNextSqe(pending->owner->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = rio->rio_fd;
+    sqe->addr = (unsigned long)(rio->rio_buf + rio->rio_cnt);
+    sqe->len = rio->rio_bufsize - rio->rio_cnt;
+    sqe->user_data = (unsigned long)pending;
+}
+
+void uringWake(master_info_t *master_info) {
+    struct io_uring_sqe *sqe = uringNextSqe(master_info->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = master_info->wakefd;
+    sqe->addr = (unsigned long)&master_info->wake_count;
+    sqe->len = sizeof(master_info->wake_count);
+    sqe->user_data = URING_WAKE;
+}
+
+void uringTick(master_info_t *master_info, struct __kernel_timespec *interval) {
+    struct io_uring_sqe *sqe = uringNextSqe(master_info->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)interval;
+    sqe->len = 1;
+    sqe->user_data = URING_TICK;
+}
+
+void uringAccepted(shared_info_t *sh_info, master_info_t *master_info, int connfd) {
+    pending_conn_t *pending = createPending(sh_info, master_info, connfd);
+    if (pending == NULL)
+        return;
+    pending->deadline = time(NULL) + KEEPALIVE_TIMEOUT;
+    uringRecv(sh_info, pending);
+}
+
+// a read of a pending connection completed with res bytes (or -errno)
+void uringReceived(shared_info_t *sh_info, master_info_t *master_info, pending_conn_t *pending, int res) {
+    rio_t *rio = &pending->rio;
+    if (pending->closing) { // timed out, already out of the list
+        Close(rio->rio_fd);
+        free(pending);
+        return;
+    }
+    pthread_mutex_lock(&sh_info->pending_mutex);
+    unlinkPending(sh_info, pending);
+    pthread_mutex_unlock(&sh_info->pending_mutex);
+    if (res <= 0) { // the client went away (or broke) before sending a whole header
+        Close(rio->rio_fd);
+        free(pending);
+        return;
+    }
+    int checked = rio->rio_cnt;
+    rio->rio_cnt += res;
+    // the next request of a kept alive connection arrives now, not when the connection was accepted
+    if (pending->requests > 0 && checked == 0)
+        DO_SYS(gettimeofday(&pending->accept_time, NULL));
+    // a full buffer without the end of the header is handed over as well, the worker reads the rest
+    if (httpHeaderEnd(rio->rio_buf, checked, rio->rio_cnt) == 0 && rio->rio_cnt < rio->rio_bufsize) {
+        uringRecv(sh_info, pending);
+        return;
+    }
+    master_info->connfd = rio->rio_fd;
+    master_info->accept_time = pending->accept_time;
+    enqueueRequest(sh_info, master_info, pending);
+}
+
+// read on the connections the workers gave back
+void uringReturned(shared_info_t *sh_info, master_info_t *master_info) {
+    pthread_mutex_lock(&sh_info->pending_mutex);
+    pending_conn_t *pending = master_info->returned;
+    master_info->returned = NULL;
+    pthread_mutex_unlock(&sh_info->pending_mutex);
+    while (pending != NULL) {
+        pending_conn_t *next = pending->next;
+        uringRecv(sh_info, pending);
+        pending = next;
+    }
+}
+
+// keepalive: cancel the reads of the connections of this master that waited too long for a request.
+// a read may complete (or be cancelled) only later, the connection is closed then
+void cancelIdlePending(shared_info_t *sh_info, master_info_t *master_info) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&sh_info->pending_mutex);
+    pending_conn_t *pending = sh_info->pending_head;
+    while (pending != NULL) {
+        pending_conn_t *next = pending->next;
+        if (pending->owner == master_info && pending->deadline <= now) {
+            unlinkPending(sh_info, pending);
+            pending->closing = true;
+            struct io_uring_sqe *sqe = uringNextSqe(master_info->ring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (unsigned long)pending;
+            sqe->user_data = URING_CANCEL;
+        }
+        pending = next;
+    }
+    pthread_mutex_unlock(&sh_info->pending_mutex);
+}
+
+void runUringMaster(shared_info_t *sh_info, master_info_t *master_info) {
+    uring_t *ring = master_info->ring;
+    raiseDescriptorLimit();
+    DO_SYS(master_info->wakefd = eventfd(0, EFD_CLOEXEC));
+    master_info->returned = NULL;
+    master_info->multishot_accept = true;
+    struct __kernel_timespec interval = {.tv_sec = 1, .tv_nsec = 0};
+    uringAccept(master_info);
+    uringWake(master_info);
+    if (sh_info->options.keepalive)
+        uringTick(master_info, &interval);
+
+    while (1) {
+        // one system call submits everything the last round queued and waits for the next completion
+        DO_SYS(uringSubmit(ring, 1));
+        struct io_uring_cqe *cqe;
+        while ((cqe = uringPeekCqe(ring)) != NULL) {
+            unsigned long tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uringCqeSeen(ring);
+            if (tag == URING_ACCEPT) {
+                if (res >= 0) {
+                    uringAccepted(sh_info, master_info, res);
+                } else if (res == -EINVAL && master_info->multishot_accept) {
+                    master_info->multishot_accept = false; // older kernel, one accept per submission
+                } else if (res != -ECONNABORTED && res != -EINTR) {
+                    errno = -res;
+                    perror("accept"); // e.g. out of descriptors, the rest stay in the backlog
+                }
+                if (!(flags & IORING_CQE_F_MORE))
+                    uringAccept(master_info);
+            } else if (tag == URING_WAKE) {
+                uringReturned(sh_info, master_info);
+                uringWake(master_info);
+            } else if (tag == URING_TICK) {
+                cancelIdlePending(sh_info, master_info);
+                uringTick(master_info, &interval);
+            } else if (tag != URING_CANCEL) {
+                uringReceived(sh_info, master_info, (pending_conn_t *)tag, res);
+            }
+        }
     }
 }
 
+// a ring for every master, or none at all if this kernel lacks io_uring (or an operation it needs)
+bool setupUring(master_info_t *masters, int acceptors) {
+    const int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ, IORING_OP_TIMEOUT,
+                          IORING_OP_ASYNC_CANCEL};
+    for (int i = 0; i < acceptors; i++) {
+        masters[i].ring = malloc(sizeof(uring_t));
+        char reason[MAXLINE] = "";
+        if (uringInit(masters[i].ring, URING_ENTRIES) < 0) {
+            snprintf(reason, MAXLINE, "no io_uring (%s)", strerror(errno));
+            free(masters[i].ring);
+            masters[i].ring = NULL;
+        }
+        for (int op = 0; masters[i].ring != NULL && op < sizeof(needed) / sizeof(needed[0]); op++) {
+            if (!uringSupports(masters[i].ring, needed[op])) {
+                snprintf(reason, MAXLINE, "io_uring without operation %d", needed[op]);
+                uringExit(masters[i].ring);
+                free(masters[i].ring);
+                masters[i].ring = NULL;
+            }
+        }
+        if (masters[i].ring == NULL) {
+            fprintf(stderr, "uring: %s, using the %s master\n", reason,
+                    masters[i].sh_info->options.epoll ? "epoll" : "blocking");
+            for (int j = 0; j < i; j++) {
+                uringExit(masters[j].ring);
+                free(masters[j].ring);
+                masters[j].ring = NULL;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
 // parse the cmd arguments
-void getargs(int *port, int *threads_num, int *queue_capacity, overload_alg_func *sched_alg, int argc, char *argv[]) {
+void getargs(int *port, int *threads_num, int *queue_capacity, overload_alg_func *sched_alg, server_options_t *options,
+             int argc, char *argv[]) {
     if (argc < CMD_ARGS_NUM) {
-        fprintf(stderr, "Usage: %s <port> <threads> <queue_size> <schedalg>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <port> <threads> <queue_size> <schedalg> [epoll] [keepalive] [cache[=<MB>]] [lockfree|steal] [acceptors=<n>] [fcgi=<program>:<n>...] [asynccgi] [bufsize=<KB>] [uring]\n",
+                argv[0]);
         exit(1);
     }
     *port = atoi(argv[1]);
@@ -361,27 +1289,119 @@ void getargs(int *port, int *threads_num, int *queue_capacity, overload_alg_func
     } else {
         printf("Error: invalid argument '%s'\n", policy); //
     }
+
+    // optional words after the policy
+    options->epoll = false;
+    options->keepalive = false;
+    options->cache_capacity = 0;
+    options->lockfree = false;
+    options->steal = false;
+    options->acceptors = 1;
+    options->fcgi_count = 0;
+    options->async_cgi = false;
+    options->uring = false;
+    options->read_buffer_size = RIO_BUFSIZE;
+    for (int i = CMD_ARGS_NUM; i < argc; i++) {
+        if (strcmp(argv[i], "epoll") == 0) {
+            options->epoll = true;
+        } else if (strcmp(argv[i], "keepalive") == 0) {
+            options->keepalive = true;
+        } else if (strcmp(argv[i], "cache") == 0) {
+            options->cache_capacity = CACHE_DEFAULT_CAPACITY;
+        } else if (strncmp(argv[i], "cache=", 6) == 0 && atoi(argv[i] + 6) > 0) {
+            options->cache_capacity = (size_t)atoi(argv[i] + 6) << 20;
+        } else if (strcmp(argv[i], "lockfree") == 0) {
+            options->lockfree = true;
+        } else if (strcmp(argv[i], "steal") == 0) {
+            options->steal = true;
+        } else if (strncmp(argv[i], "acceptors=", 10) == 0 && atoi(argv[i] + 10) > 0) {
+            options->acceptors = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "fcgi=", 5) == 0 && strchr(argv[i], ':') != NULL &&
+                   atoi(strchr(argv[i], ':') + 1) > 0 && options->fcgi_count < FCGI_MAX_PROGRAMS) {
+            char *colon = strchr(argv[i], ':');
+            char *path = malloc(MAXLINE);
+            snprintf(path, MAXLINE, "./public/%.*s", (int)(colon - argv[i] - 5), argv[i] + 5); // as request.c names it
+            options->fcgi_paths[options->fcgi_count] = path;
+            options->fcgi_processes[options->fcgi_count] = atoi(colon + 1);
+            options->fcgi_count += 1;
+        } else if (strcmp(argv[i], "asynccgi") == 0) {
+            options->async_cgi = true;
+        } else if (strncmp(argv[i], "bufsize=", 8) == 0 && atoi(argv[i] + 8) > 0) {
+            options->read_buffer_size = atoi(argv[i] + 8) << 10;
+        } else if (strcmp(argv[i], "uring") == 0) {
+            options->uring = true;
+        } else {
+            printf("Error: invalid argument '%s'\n", argv[i]);
+        }
+    }
+}
+
+// prints the cache counters whenever the server gets SIGUSR1 (blocked in every other thread)
+void *cacheReporter(void *unused) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    while (1) {
+        int signal;
+        if (sigwait(&signals, &signal) != 0)
+            continue;
+        cache_stats_t stats;
+        cacheGetStats(&stats);
+        long lookups = stats.hits + stats.misses;
+        printf("cache: %ld hits, %ld misses (%.1f%% hit rate), %ld evictions, %ld files, %zu/%zu bytes\n", //
+               stats.hits, stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0, stats.evictions,
+               stats.entries, stats.bytes, stats.capacity);
+        fflush(stdout);
+    }
+}
+
+void startCache(size_t capacity) {
+    cacheInit(capacity);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    DO_SYS(pthread_sigmask(SIG_BLOCK, &signals, NULL)); // inherited by the threads created later
+    pthread_t reporter;
+    DO_SYS(pthread_create(&reporter, NULL, cacheReporter, NULL));
 }
 
 // Method that creates a pool of worker threads
 thread_info_t *createWorkersPool(int num_threads, shared_info_t *sh_info) {
     // Allocate memory for the thread info array
-    thread_info_t *thread_pool = malloc(num_threads * sizeof(thread_info_t));
+    thread_info_t *thread_pool = aligned_alloc(CACHE_LINE, num_threads * sizeof(thread_info_t));
 
     // Create the worker threads
     for (int i = 0; i < num_threads; i++) {
         thread_pool[i].thread_id = i;
-        thread_pool[i].requests_count = 0;
-        thread_pool[i].static_requests_count = 0;
-        thread_pool[i].dynamic_requests_count = 0;
+        atomic_init(&thread_pool[i].requests_count, 0);
+        atomic_init(&thread_pool[i].static_requests_count, 0);
+        atomic_init(&thread_pool[i].dynamic_requests_count, 0);
         thread_pool[i].sh_info = sh_info;
         thread_pool[i].self = malloc(sizeof(pthread_t));
+        thread_pool[i].read_buf = malloc(sh_info->options.read_buffer_size);
+        thread_pool[i].scratch = requestScratchCreate();
+        if (thread_pool[i].self == NULL || thread_pool[i].read_buf == NULL || thread_pool[i].scratch == NULL) {
+            perror("malloc");
+            exit(1);
+        }
         DO_SYS(pthread_create(thread_pool[i].self, NULL, workerFunction, &thread_pool[i]));
     }
 
     return thread_pool;
 }
 
+void *masterFunction(void *info) {
+    master_info_t *master_info = info;
+    LOG(printf("master %d listening\n", master_info->id));
+    if (master_info->ring != NULL)
+        runUringMaster(master_info->sh_info, master_info);
+    else if (master_info->sh_info->options.epoll)
+        runEventMaster(master_info->sh_info, master_info);
+    else
+        runMaster(master_info->sh_info, master_info);
+    return NULL;
+}
+
 requests_queue_t *createRequestQueue(int queue_capacity) {
     requests_queue_t *requests_queue = malloc(sizeof(requests_queue_t));
     requests_queue->items = malloc(queue_capacity * sizeof(request_t));
@@ -391,34 +1411,109 @@ requests_queue_t *createRequestQueue(int queue_capacity) {
     return requests_queue;
 }
 
+queue_sync_t *createQueueSync() {
+    queue_sync_t *sync = aligned_alloc(CACHE_LINE, sizeof(queue_sync_t));
+    atomic_init(&sync->pushes, 0);
+    atomic_init(&sync->parked, 0);
+    atomic_init(&sync->completions, 0);
+    atomic_init(&sync->masters_parked, 0);
+    atomic_init(&sync->in_flight, 0);
+    pthread_mutex_init(&sync->masters, NULL);
+    return sync;
+}
+
+requests_ring_t *createRequestRing(int queue_capacity) {
+    size_t slots = 1;
+    while (slots < (size_t)queue_capacity)
+        slots <<= 1;
+    requests_ring_t *ring = aligned_alloc(CACHE_LINE, sizeof(requests_ring_t));
+    ring->slots = malloc(slots * sizeof(ring_slot_t));
+    for (size_t i = 0; i < slots; i++)
+        atomic_init(&ring->slots[i].sequence, i);
+    ring->mask = slots - 1;
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+    return ring;
+}
+
+worker_deque_t *createWorkerDeques(int threads_num, int queue_capacity) {
+    worker_deque_t *deques = aligned_alloc(CACHE_LINE, threads_num * sizeof(worker_deque_t));
+    for (int i = 0; i < threads_num; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].items = malloc(queue_capacity * sizeof(request_t));
+        deques[i].head = 0;
+        deques[i].tail = 0;
+        deques[i].size = 0;
+    }
+    return deques;
+}
+
 requests_list_t *createRequestList(int queue_capacity) {
     requests_list_t *requests_list = malloc(sizeof(requests_list_t));
     requests_list->items = malloc(queue_capacity * sizeof(request_t));
-    requests_list->size = 0;
     return requests_list;
 }
 
 int main(int argc, char *argv[]) {
     int port, threads_num, queue_capacity; // cmd args
     overload_alg_func policy;
-    getargs(&port, &threads_num, &queue_capacity, &policy, argc, argv);
+    shared_info_t sh_info;
+    getargs(&port, &threads_num, &queue_capacity, &policy, &sh_info.options, argc, argv);
+    // a client that goes away in the middle of a response is an error for that connection only:
+    // sendfile cannot be told MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
 
     // create request queue
-    shared_info_t sh_info;
     sh_info.queue_capacity = queue_capacity;
     sh_info.requests_queue = createRequestQueue(queue_capacity); // request waiting for worker
     sh_info.requests_list = createRequestList(threads_num);      // requests currently handled by some worker
+    sh_info.threads_num = threads_num;
+    sh_info.queue_sync = createQueueSync();
+    sh_info.requests_ring = NULL;
+    sh_info.worker_deques = NULL;
+    sh_info.queue = &mutex_queue;
+    if (sh_info.options.steal) {
+        sh_info.worker_deques = createWorkerDeques(threads_num, queue_capacity);
+        sh_info.queue = &steal_queue;
+    } else if (sh_info.options.lockfree) {
+        sh_info.requests_ring = createRequestRing(queue_capacity);
+        sh_info.queue = &lockfree_queue;
+    }
 
     // init locks and conditions
     pthread_mutex_init(&sh_info.queue_mutex, NULL);
     pthread_cond_init(&sh_info.queue_not_empty, NULL);
     pthread_cond_init(&sh_info.queue_not_full, NULL);
+    pthread_mutex_init(&sh_info.pending_mutex, NULL);
+    sh_info.pending_head = NULL;
+
+    for (int i = 0; i < sh_info.options.fcgi_count; i++)
+        fcgiRegister(sh_info.options.fcgi_paths[i], sh_info.options.fcgi_processes[i]);
+    if (sh_info.options.async_cgi)
+        cgiReaperStart();
+
+    if (sh_info.options.cache_capacity > 0)
+        startCache(sh_info.options.cache_capacity);
 
     // create workers pool and start processing requests
-    master_info_t master_info;
-    master_info.policy = policy;
-    master_info.workers_pool = createWorkersPool(threads_num, &sh_info);
-    master_info.listenfd = Open_listenfd(port);
-    LOG(printf("master listening\n"));
-    runMaster(port, &sh_info, &master_info);
+    thread_info_t *workers_pool = createWorkersPool(threads_num, &sh_info);
+    int acceptors = sh_info.options.acceptors;
+    master_info_t *masters = malloc(acceptors * sizeof(master_info_t));
+    for (int i = 0; i < acceptors; i++) { // every socket listens before any master accepts
+        masters[i].policy = policy;
+        masters[i].workers_pool = workers_pool;
+        masters[i].sh_info = &sh_info;
+        masters[i].id = i;
+        masters[i].next_deque = i;
+        masters[i].epfd = -1;
+        masters[i].ring = NULL;
+        masters[i].listenfd = Open_listenfd_reuseport(port, acceptors > 1);
+    }
+    if (sh_info.options.uring)
+        setupUring(masters, acceptors);
+    for (int i = 1; i < acceptors; i++) {
+        pthread_t master;
+        DO_SYS(pthread_create(&master, NULL, masterFunction, &masters[i]));
+    }
+    masterFunction(&masters[0]);
 }
@@ -0,0 +1,378 @@
+import os
+import socket
+import struct
+from signal import SIGINT, SIGKILL, SIGUSR1
+from time import sleep, time
+import pytest
+
+from server import Server, server_port
+
+"""
+Tests for the optional server modes (extra words after the policy).
+They only use plain sockets, so they also run without the requests packages.
+"""
+
+REQUEST = b"GET /home.html HTTP/1.0\r\n\r\n"
+
+
+def read_response(sock):
+    data = b""
+    while True:
+        chunk = sock.recv(4096)
+        if not chunk:
+            return data
+        data += chunk
+
+
+def fetch(port, request=REQUEST):
+    with socket.create_connection(("localhost", port)) as sock:
+        sock.sendall(request)
+        return read_response(sock)
+
+
+@pytest.mark.parametrize("policy", ["block", "dt", "dh", "random"])
+def test_epoll_basic(policy, server_port):
+    with Server("./server", server_port, 2, 4, policy, "epoll") as server:
+        sleep(0.1)
+        for path in ["/home.html", "/favicon.ico", "/output.cgi?0.1"]:
+            response = fetch(server_port, f"GET {path} HTTP/1.0\r\n\r\n".encode())
+            assert response.startswith(b"HTTP/1.0 200 OK\r\n")
+        response = fetch(server_port, b"GET /missing.html HTTP/1.0\r\n\r\n")
+        assert response.startswith(b"HTTP/1.0 404 Not found\r\n")
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+@pytest.mark.parametrize("master", ["epoll", "uring"])
+def test_epoll_slow_clients_do_not_hold_workers(master, server_port):
+    """a single worker still serves while many clients sit on half sent headers"""
+    with Server("./server", server_port, 1, 4, "block", master) as server:
+        sleep(0.1)
+        slow = []
+        for _ in range(100):
+            sock = socket.create_connection(("localhost", server_port))
+            sock.sendall(b"GET /home.html HTTP/1.0\r\nHost: localhost\r\n")
+            slow.append(sock)
+        start = time()
+        assert fetch(server_port).startswith(b"HTTP/1.0 200 OK\r\n")
+        assert time() - start < 1
+        # the slow ones are served once their header is done
+        for sock in slow[:4]:
+            sock.sendall(b"\r\n")
+            assert read_response(sock).startswith(b"HTTP/1.0 200 OK\r\n")
+        for sock in slow:
+            sock.close()
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+@pytest.mark.parametrize("master", ["epoll", "uring"])
+def test_epoll_header_in_pieces(master, server_port):
+    with Server("./server", server_port, 1, 1, "block", master) as server:
+        sleep(0.1)
+        with socket.create_connection(("localhost", server_port)) as sock:
+            for i in range(len(REQUEST)):
+                sock.sendall(REQUEST[i:i + 1])
+                sleep(0.001)
+            assert read_response(sock).startswith(b"HTTP/1.0 200 OK\r\n")
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+@pytest.mark.parametrize("mode", [[], ["epoll"], ["uring"]])
+def test_header_parsing(mode, server_port):
+    """bare line feeds end lines too, and a header too large for the read buffer is refused whole"""
+    with Server("./server", server_port, 1, 4, "block", "keepalive", *mode) as server:
+        sleep(0.1)
+        assert fetch(server_port, b"GET /home.html HTTP/1.0\nHost: localhost\n\n").startswith(b"HTTP/1.1 200 OK\r\n")
+        response = fetch(server_port, b"GET /home.html HTTP/1.1\r\nCookie: " + b"a" * 20000 + b"\r\n\r\n")
+        assert response.startswith(b"HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\n")
+        response = fetch(server_port, b"GET /home.html HTTP/1.1\r\nHost: localhost\r\nconnection:   CLOSE \r\n\r\n")
+        assert response.startswith(b"HTTP/1.1 200 OK\r\nConnection: close\r\n")
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+@pytest.mark.parametrize("mode", [[], ["epoll"], ["uring"]])
+def test_bufsize(mode, server_port):
+    """the read buffer size bounds the request header, requests after a refused one still work"""
+    with Server("./server", server_port, 1, 4, "block", "bufsize=1", *mode) as server:
+        sleep(0.1)
+        for _ in range(2):  # the worker reuses its buffers
+            response = fetch(server_port, b"GET /home.html HTTP/1.0\r\nX: " + b"a" * 900 + b"\r\n\r\n")
+            assert response.startswith(b"HTTP/1.0 200 OK\r\n")
+            response = fetch(server_port, b"GET /home.html HTTP/1.0\r\nX: " + b"a" * 1100 + b"\r\n\r\n")
+            assert response.startswith(b"HTTP/1.0 431 Request Header Fields Too Large\r\n")
+            assert b"I spun for 0.0" in fetch(server_port, b"GET /output.cgi?0 HTTP/1.0\r\n\r\n")
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+def test_blocking_drop_tail_keeps_serving(server_port):
+    """dt drops the newest connection and the master goes back to accepting"""
+    with Server("./server", server_port, 1, 1, "dt") as server:
+        sleep(0.1)
+        busy = socket.create_connection(("localhost", server_port))
+        busy.sendall(b"GET /output.cgi?0.5 HTTP/1.0\r\n\r\n")
+        sleep(0.1)
+        assert fetch(server_port) == b""
+        assert read_response(busy).startswith(b"HTTP/1.0 200 OK\r\n")
+        busy.close()
+        assert fetch(server_port).startswith(b"HTTP/1.0 200 OK\r\n")
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+def test_client_reset_mid_download(server_port):
+    """a client that resets the connection in the middle of a sendfile body ends only that connection"""
+    with open("../public/big.bin", "wb") as big:
+        big.write(os.urandom(1024) * 50 * 1024)
+    try:
+        with Server("./server", server_port, 2, 4, "block", "keepalive") as server:
+            sleep(0.1)
+            for _ in range(3):
+                sock = socket.create_connection(("localhost", server_port))
+                sock.sendall(b"GET /big.bin HTTP/1.1\r\n\r\n")
+                sock.recv(1024)
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))  # close sends RST
+                sock.close()
+            sleep(0.2)
+            assert server.poll() is None
+            assert fetch(server_port).startswith(b"HTTP/1.1 200 OK\r\n")
+            server.send_signal(SIGINT)
+            server.communicate()
+    finally:
+        os.remove("../public/big.bin")
+
+
+def read_one_response(sock, buffered=b""):
+    """read one response with a Content-Length body, returns (response, bytes after it)"""
+    data = buffered
+    while b"\r\n\r\n" not in data:
+        chunk = sock.recv(4096)
+        assert chunk, "connection closed before a whole response"
+        data += chunk
+    head, body = data.split(b"\r\n\r\n", 1)
+    length = [int(line.split(b":")[1]) for line in head.split(b"\r\n") if line.startswith(b"Content-Length")][0]
+    while len(body) < length:
+        body += sock.recv(4096)
+    return head + b"\r\n\r\n" + body[:length], body[length:]
+
+
+@pytest.mark.parametrize("mode", [[], ["epoll"], ["uring"]])
+def test_keepalive_serves_several_requests(mode, server_port):
+    with Server("./server", server_port, 1, 2, "block", "keepalive", *mode) as server:
+        sleep(0.1)
+        with socket.create_connection(("localhost", server_port)) as sock:
+            for count in range(1, 4):
+                sock.sendall(b"GET /home.html HTTP/1.1\r\nHost: localhost\r\n\r\n")
+                response, rest = read_one_response(sock)
+                assert rest == b""
+                assert response.startswith(b"HTTP/1.1 200 OK\r\n")
+                assert b"Connection: keep-alive\r\n" in response
+                assert f"Keep-Alive: timeout=5, max={100 - count}\r\n".encode() in response
+                # one worker, so the statistics count every request of the connection
+                assert f"Stat-Thread-Count:: {count}\r\n".encode() in response
+                assert f"Stat-Thread-Static:: {count}\r\n".encode() in response
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+@pytest.mark.parametrize("mode", [[], ["epoll"], ["uring"]])
+def test_keepalive_pipelining(mode, server_port):
+    with Server("./server", server_port, 1, 2, "block", "keepalive", *mode) as server:
+        sleep(0.1)
+        with socket.create_connection(("localhost", server_port)) as sock:
+            sock.sendall(b"GET /home.html HTTP/1.1\r\n\r\n"
+                         b"GET /missing.html HTTP/1.1\r\n\r\n"
+                         b"GET /home.html HTTP/1.1\r\nConnection: close\r\n\r\n")
+            first, rest = read_one_response(sock)
+            second, rest = read_one_response(sock, rest)
+            third, rest = read_one_response(sock, rest)
+            assert first.startswith(b"HTTP/1.1 200 OK\r\n")
+            assert second.startswith(b"HTTP/1.1 404 Not found\r\n")
+            assert third.startswith(b"HTTP/1.1 200 OK\r\n")
+            assert b"Connection: close\r\n" in third
+            assert rest == b"" and sock.recv(1) == b""
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+def test_keepalive_closes_dynamic_and_http10(server_port):
+    with Server("./server", server_port, 1, 2, "block", "keepalive") as server:
+        sleep(0.1)
+        response = fetch(server_port, b"GET /output.cgi?0.1 HTTP/1.1\r\n\r\n")
+        assert response.startswith(b"HTTP/1.1 200 OK\r\nConnection: close\r\n")
+        response = fetch(server_port, b"GET /home.html HTTP/1.0\r\n\r\n")
+        assert response.startswith(b"HTTP/1.1 200 OK\r\nConnection: close\r\n")
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+@pytest.mark.parametrize("master", ["epoll", "uring"])
+def test_keepalive_idle_timeout(master, server_port):
+    with Server("./server", server_port, 1, 2, "block", "keepalive", master) as server:
+        sleep(0.1)
+        with socket.create_connection(("localhost", server_port)) as sock:
+            sock.sendall(b"GET /home.html HTTP/1.1\r\n\r\n")
+            read_one_response(sock)
+            start = time()
+            assert sock.recv(1) == b""
+            assert 4 <= time() - start < 7
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+def test_cache_serves_from_memory(server_port):
+    with Server("./server", server_port, 2, 4, "block", "cache") as server:
+        sleep(0.1)
+        responses = [fetch(server_port) for _ in range(3)]
+        assert responses[0].startswith(b"HTTP/1.0 200 OK\r\n")
+        bodies = [response.split(b"\r\n\r\n", 1)[1] for response in responses]
+        with open("../public/home.html", "rb") as home:
+            assert bodies == [home.read()] * 3
+        server.send_signal(SIGUSR1)
+        sleep(0.1)
+        server.send_signal(SIGINT)
+        out, err = server.communicate()
+        assert "cache: 2 hits, 1 misses" in out
+
+
+@pytest.mark.parametrize("mode", ["lockfree", "steal"])
+@pytest.mark.parametrize("policy, dropped", [("block", []), ("dt", [2]), ("dh", [1]), ("random", [1])])
+def test_queue_mode_policies(mode, policy, dropped, server_port):
+    """one worker busy and one request queued fill a queue of 2, the policy decides about the third"""
+    with Server("./server", server_port, 1, 2, policy, mode) as server:
+        sleep(0.1)
+        socks = []
+        for path in ["/output.cgi?0.5", "/home.html", "/home.html"]:
+            sock = socket.create_connection(("localhost", server_port))
+            sock.sendall(f"GET {path} HTTP/1.0\r\n\r\n".encode())
+            socks.append(sock)
+            sleep(0.1)
+        for i, sock in enumerate(socks):
+            try:
+                response = read_response(sock)
+            except ConnectionResetError:  # closed with its request unread
+                response = b""
+            sock.close()
+            if i in dropped:
+                assert response == b""
+            else:
+                assert response.startswith(b"HTTP/1.0 200 OK\r\n")
+        assert fetch(server_port).startswith(b"HTTP/1.0 200 OK\r\n")
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+def test_steal_idle_worker_takes_queued_request(server_port):
+    """requests queued behind a busy worker are served by the idle one"""
+    with Server("./server", server_port, 2, 8, "block", "steal") as server:
+        sleep(0.1)
+        busy = socket.create_connection(("localhost", server_port))
+        busy.sendall(b"GET /output.cgi?1 HTTP/1.0\r\n\r\n")
+        sleep(0.1)
+        start = time()
+        for _ in range(4):  # every other one lands in the busy worker's queue
+            assert fetch(server_port).startswith(b"HTTP/1.0 200 OK\r\n")
+        assert time() - start < 0.8
+        assert read_response(busy).startswith(b"HTTP/1.0 200 OK\r\n")
+        busy.close()
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+@pytest.mark.parametrize("modes", [[], ["epoll", "keepalive"], ["steal"], ["lockfree", "epoll"]])
+def test_acceptors(modes, server_port):
+    """connections are spread over the listening sockets of 3 masters, all of them get served"""
+    with Server("./server", server_port, 4, 8, "block", "acceptors=3", *modes) as server:
+        sleep(0.1)
+        socks = [socket.create_connection(("localhost", server_port)) for _ in range(24)]
+        for sock in socks:
+            sock.sendall(REQUEST)
+        for sock in socks:
+            assert read_response(sock).split(b"\r\n")[0].endswith(b" 200 OK")
+            sock.close()
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+def test_fcgi_pool(server_port):
+    """dynamic requests run on the pooled processes, a process that died is replaced"""
+    with Server("./server", server_port, 4, 8, "block", "fcgi=output.cgi:2") as server:
+        pooled = []
+        for _ in range(20):  # the pool is up before the server listens
+            sleep(0.1)
+            with open(f"/proc/{server.pid}/task/{server.pid}/children") as children:
+                pooled = children.read().split()
+            if len(pooled) == 2:
+                break
+        assert len(pooled) == 2
+        socks = []
+        start = time()
+        for _ in range(4):
+            sock = socket.create_connection(("localhost", server_port))
+            sock.sendall(b"GET /output.cgi?0.3 HTTP/1.0\r\n\r\n")
+            socks.append(sock)
+        for sock in socks:
+            response = read_response(sock)
+            assert response.startswith(b"HTTP/1.0 200 OK\r\n")
+            assert b"I spun for 0.3" in response  # measured by the script, a busy machine adds a hundredth
+            sock.close()
+        assert 0.6 <= time() - start < 1.5  # two processes, two rounds
+        for pid in pooled:
+            os.kill(int(pid), SIGKILL)
+        sleep(0.1)
+        for _ in range(3):
+            assert b"I spun for 0.0" in fetch(server_port, b"GET /output.cgi?0 HTTP/1.0\r\n\r\n")
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+def test_asynccgi_does_not_hold_worker(server_port):
+    """a single worker starts three slow scripts and still serves a static file at once"""
+    with Server("./server", server_port, 1, 8, "block", "asynccgi") as server:
+        sleep(0.1)
+        start = time()
+        slow = []
+        for _ in range(3):
+            sock = socket.create_connection(("localhost", server_port))
+            sock.sendall(b"GET /output.cgi?1 HTTP/1.0\r\n\r\n")
+            slow.append(sock)
+        sleep(0.1)
+        assert fetch(server_port).startswith(b"HTTP/1.0 200 OK\r\n")
+        assert time() - start < 0.8
+        for sock in slow:
+            response = read_response(sock)
+            assert response.startswith(b"HTTP/1.0 200 OK\r\n")
+            assert b"I spun for 1.0" in response
+            sock.close()
+        assert time() - start < 1.8
+        sleep(0.1)
+        for task in os.listdir(f"/proc/{server.pid}/task"):  # the workers started them
+            with open(f"/proc/{server.pid}/task/{task}/children") as children:
+                assert children.read().split() == []  # reaped
+        server.send_signal(SIGINT)
+        server.communicate()
+
+
+@pytest.mark.parametrize("modes", [[], ["keepalive", "acceptors=2"]])
+def test_uring_master(modes, server_port):
+    """the masters run on io_uring where the kernel has it, and fall back to the blocking master where it does not"""
+    with Server("./server", server_port, 2, 8, "dt", "uring", *modes) as server:
+        sleep(0.1)
+        rings = [fd for fd in os.listdir(f"/proc/{server.pid}/fd")
+                 if os.readlink(f"/proc/{server.pid}/fd/{fd}") == "anon_inode:[io_uring]"]
+        for path in ["/home.html", "/output.cgi?0.1"]:
+            response = fetch(server_port, f"GET {path} HTTP/1.0\r\n\r\n".encode())
+            assert response.split(b"\r\n")[0].endswith(b" 200 OK")
+        # a client that leaves before finishing its header is dropped without a worker
+        with socket.create_connection(("localhost", server_port)) as sock:
+            sock.sendall(b"GET /home")
+        assert fetch(server_port).split(b"\r\n")[0].endswith(b" 200 OK")
+        server.send_signal(SIGINT)
+        _, err = server.communicate()
+        if rings:
+            assert len(rings) == (2 if modes else 1) and "uring:" not in err
+        else:
+            assert "using the blocking master" in err
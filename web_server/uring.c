@@ -0,0 +1,108 @@
+//
+// uring.c: A minimal io_uring on the raw system calls. See uring.h.
+//
+
+#include "uring.h"
+#include "segel.h"
+#include <sys/syscall.h>
+
+int uringInit(uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params); // close on exec
+    if (ring->fd < 0)
+        return -1;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) { // both rings in one mapping
+        if (cq_size > sq_size)
+            sq_size = cq_size;
+        cq_size = sq_size;
+    }
+    char *sq = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->sq_map = sq == MAP_FAILED ? NULL : sq;
+    ring->sq_map_size = sq_size;
+    ring->cq_map = cq == MAP_FAILED ? NULL : cq;
+    ring->cq_map_size = cq_size;
+    ring->sq_entries = params.sq_entries;
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int mmap_errno = errno;
+        if (ring->sqes == MAP_FAILED)
+            ring->sqes = NULL;
+        uringExit(ring);
+        errno = mmap_errno;
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uringExit(uring_t *ring) {
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map != NULL)
+        munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+bool uringSupports(uring_t *ring, int opcode) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported = syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                     opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+struct io_uring_sqe *uringGetSqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+        return NULL;
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail += 1;
+    return sqe;
+}
+
+int uringSubmit(uring_t *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while (1) {
+        // what the kernel did not consume yet, an interrupted call may have taken some
+        unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        int ret = syscall(SYS_io_uring_enter, ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                          NULL, 0);
+        if (ret >= 0 || errno != EINTR)
+            return ret < 0 ? -1 : ret;
+    }
+}
+
+struct io_uring_cqe *uringPeekCqe(uring_t *ring) {
+    unsigned head = *ring->cq_head; // only this thread moves it
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uringCqeSeen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
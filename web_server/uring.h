@@ -0,0 +1,56 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "stdbool.h"
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+//
+// uring.h: A minimal io_uring on the raw system calls (the uring server option).
+//
+// Operations are queued as submission entries and handed to the kernel in one io_uring_enter, which
+// also waits for completions. One thread owns a ring, nothing here is thread safe.
+//
+
+typedef struct uring {
+    int fd;
+    // the mappings of the rings, the completion ring may share the submission one's
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    // submission ring, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // entries handed out, published to the kernel by uringSubmit
+    struct io_uring_sqe *sqes;
+    // completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+// -1 (errno set) if the kernel does not have io_uring or it is disabled
+int uringInit(uring_t *ring, unsigned entries);
+
+// unmap and close a ring set up by uringInit
+void uringExit(uring_t *ring);
+
+// true if the kernel knows this IORING_OP_
+bool uringSupports(uring_t *ring, int opcode);
+
+// a zeroed submission entry, NULL if the ring is full until the next uringSubmit
+struct io_uring_sqe *uringGetSqe(uring_t *ring);
+
+// submit the queued entries and wait until wait_nr completions are there. -1 (errno set) on error
+int uringSubmit(uring_t *ring, unsigned wait_nr);
+
+// the oldest completion or NULL, it stays in the ring until uringCqeSeen
+struct io_uring_cqe *uringPeekCqe(uring_t *ring);
+void uringCqeSeen(uring_t *ring);
+
+#endif